@@ -0,0 +1,345 @@
+/************************************************************************
+   batch.c  -- render lots of midi files to wav files on every core
+
+   Copyright 2015 Nathan Laredo (laredo@gnu.org)
+
+   This program is modifiable/redistributable under the terms
+   of the GNU General Public Licence.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *************************************************************************/
+#include "playmidi.h"
+#include <dirent.h>
+#include <errno.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+extern int renderthreads;
+extern char *sf2_filename;
+extern int readmidi(struct midisong *, unsigned char *, off_t);
+extern unsigned char *load_midi(char *, off_t *);
+extern int playevents(struct synth *, struct midisong *);
+extern struct synth *synth_new(char *);
+extern void synth_free(struct synth *);
+extern int synth_open_wav(struct synth *, char *);
+extern void synth_close_out(struct synth *);
+
+struct batchjob {
+    char *name;		/* midi file to render */
+    int rel;		/* where in name the part mirrored in outdir starts */
+    char *out;		/* wav file to write, NULL if another job has it */
+    off_t size;		/* bytes in it, the biggest files go first */
+};
+
+static struct batchjob *jobs;
+static int njobs, maxjobs;
+static atomic_int nextjob;	/* first job no worker has taken yet */
+static char *outdir;
+
+/* totals over all files, updated as each one finishes */
+static SDL_SpinLock total_lock;
+static int failed;
+static double total_secs;
+
+static void add_job(char *name, int rel, off_t size)
+{
+    if (njobs == maxjobs) {
+	maxjobs = maxjobs ? maxjobs * 2 : 256;
+	jobs = realloc(jobs, maxjobs * sizeof(struct batchjob));
+	if (jobs == NULL) {
+	    perror("realloc");
+	    exit(1);
+	}
+    }
+    if ((jobs[njobs].name = strdup(name)) == NULL) {
+	perror("strdup");
+	exit(1);
+    }
+    jobs[njobs].rel = rel;
+    jobs[njobs].out = NULL;
+    jobs[njobs++].size = size;
+}
+
+/* the extension of name, before any .gz that follows it, with its */
+/* length in *len, or NULL if it has none */
+static char *midi_ext(char *name, size_t *len)
+{
+    char *base = strrchr(name, '/'), *dot, *end;
+
+    base = base ? base + 1 : name;
+    end = base + strlen(base);
+    if (end - base > 3 && strcasecmp(end - 3, ".gz") == 0)
+	end -= 3;
+    for (dot = end; dot > base && dot[-1] != '.'; dot--);
+    if (dot == base)		/* nothing before .gz, if that is there */
+	dot = *end ? end + 1 : NULL;
+    if (dot)
+	*len = end - --dot;
+    return dot;
+}
+
+/* nonzero if name looks like a midi file when found in a directory */
+static int is_midi(char *name)
+{
+    static char *ext[] = { ".mid", ".midi", ".kar", ".rmi", ".smf", NULL };
+    size_t len;
+    char *dot = midi_ext(name, &len);
+    int i;
+
+    for (i = 0; dot && ext[i]; i++)
+	if (strlen(ext[i]) == len && strncasecmp(dot, ext[i], len) == 0)
+	    return 1;
+    return 0;
+}
+
+/* queue file path, or every midi file in and below directory path. */
+/* outputs mirror the path below the directory named, from rel on */
+static void add_path(char *path, int named, int rel)
+{
+    struct stat info;
+    struct dirent *d;
+    char name[FILENAME_MAX];
+    DIR *dir;
+
+    /* don't follow links to directories found while scanning, they loop */
+    if ((named ? stat(path, &info) : lstat(path, &info)) == -1) {
+	perror(path);
+	return;
+    }
+    if (S_ISREG(info.st_mode)) {
+	if (named)
+	    rel = strrchr(path, '/') ? strrchr(path, '/') + 1 - path : 0;
+	if (named || is_midi(path))
+	    add_job(path, rel, info.st_size);
+	return;
+    }
+    if (!S_ISDIR(info.st_mode) || (dir = opendir(path)) == NULL)
+	return;
+    if (named)
+	rel = strlen(path) + (path[strlen(path) - 1] != '/');
+    while ((d = readdir(dir)) != NULL) {
+	if (d->d_name[0] == '.')
+	    continue;		/* also skips hidden files */
+	snprintf(name, sizeof(name), "%s%s%s", path,
+		 path[strlen(path) - 1] == '/' ? "" : "/", d->d_name);
+	add_path(name, 0, rel);
+    }
+    closedir(dir);
+}
+
+static int by_size(const void *a, const void *b)
+{
+    off_t d = ((struct batchjob *) b)->size - ((struct batchjob *) a)->size;
+
+    return d < 0 ? -1 : d > 0;
+}
+
+/* output file for job: outdir/ and the path mirrored, with .wav for */
+/* its extension and for any .gz after it, or added to all of it */
+static char *wav_name(struct batchjob *job, int keep_ext)
+{
+    char out[FILENAME_MAX], *dot, *copy;
+    size_t n;
+
+    snprintf(out, sizeof(out), "%s/%s", outdir, job->name + job->rel);
+    if (!keep_ext && (dot = midi_ext(out, &n)) != NULL)
+	*dot = '\0';
+    strncat(out, ".wav", sizeof(out) - strlen(out) - 1);
+    if ((copy = strdup(out)) == NULL) {
+	perror("strdup");
+	exit(1);
+    }
+    return copy;
+}
+
+static int by_out(const void *a, const void *b)
+{
+    return strcmp((*(struct batchjob **) a)->out,
+		  (*(struct batchjob **) b)->out);
+}
+
+/* give every job an output file no other one writes: x.mid and x.kar */
+/* become x.mid.wav and x.kar.wav, and any still clashing are dropped */
+static void name_outputs(void)
+{
+    struct batchjob **order = malloc(njobs * sizeof(struct batchjob *));
+    int i, j, k, pass;
+
+    if (order == NULL) {
+	perror("malloc");
+	exit(1);
+    }
+    for (i = 0; i < njobs; i++) {
+	jobs[i].out = wav_name(&jobs[i], 0);
+	order[i] = &jobs[i];
+    }
+    for (pass = 0; pass < 2; pass++) {
+	qsort(order, njobs, sizeof(struct batchjob *), by_out);
+	for (i = 0; i < njobs; i = j) {
+	    for (j = i + 1; j < njobs &&
+		 strcmp(order[i]->out, order[j]->out) == 0; j++)
+		if (pass == 1) {
+		    fprintf(stderr, "%s: skipped, %s also writes %s\n",
+			    order[j]->name, order[i]->name, order[i]->out);
+		    free(order[j]->out);
+		    order[j]->out = NULL;
+		}
+	    for (k = i; pass == 0 && j - i > 1 && k < j; k++) {
+		free(order[k]->out);
+		order[k]->out = wav_name(order[k], 1);
+	    }
+	}
+    }
+    free(order);
+}
+
+/* make the directories under outdir that file out goes in */
+static void make_dirs(char *out)
+{
+    char *slash;
+
+    for (slash = strchr(out + strlen(outdir) + 1, '/'); slash;
+	 slash = strchr(slash + 1, '/')) {
+	*slash = '\0';
+	mkdir(out, 0777);	/* if it fails, opening out says why */
+	*slash = '/';
+    }
+}
+
+/* render one midi file, returns seconds of audio or < 0 if it failed */
+static double render_job(struct midisong *song, struct batchjob *job,
+			 int *poly)
+{
+    unsigned char *buf;
+    struct synth *syn;
+    double secs;
+    off_t size;
+
+    if (job->out == NULL)
+	return -1;		/* its output clashed, see name_outputs() */
+    /* .gz files are inflated as they are read */
+    if ((buf = load_midi(job->name, &size)) == NULL)
+	return -1;
+    memset(song, 0, sizeof(struct midisong));
+    if (readmidi(song, buf, size) <= 0) {
+	fprintf(stderr, "%s: can't read midi data\n", job->name);
+	free(buf);
+	return -1;
+    }
+    /* a fresh synth per file, so its output doesn't depend on which
+       files the worker rendered before.  the soundfont is shared */
+    make_dirs(job->out);
+    if ((syn = synth_new(sf2_filename)) == NULL ||
+	synth_open_wav(syn, job->out) < 0) {
+	perror(job->out);
+	synth_free(syn);
+	free(buf);
+	return -1;
+    }
+    playevents(syn, song);
+    synth_close_out(syn);
+    if (syn->out_failed) {
+	fprintf(stderr, "%s: write failed\n", job->out);
+	synth_free(syn);
+	free(buf);
+	return -1;
+    }
+    secs = (syn->samplepos - syn->songpos) / syn->rate;
+    *poly = syn->poly_peak;
+    synth_free(syn);
+    free(buf);
+    return secs;
+}
+
+/* worker thread: take the next job until there are none left */
+static int batch_worker(void *data)
+{
+    struct midisong *song = malloc(sizeof(struct midisong));
+    Uint64 t0, freq = SDL_GetPerformanceFrequency();
+    double secs, wall;
+    int i, poly;
+
+    if (song == NULL) {
+	perror("malloc");
+	return -1;
+    }
+    while ((i = atomic_fetch_add(&nextjob, 1)) < njobs) {
+	t0 = SDL_GetPerformanceCounter();
+	poly = 0;
+	secs = render_job(song, &jobs[i], &poly);
+	wall = (double) (SDL_GetPerformanceCounter() - t0) / freq;
+	SDL_AtomicLock(&total_lock);
+	if (secs < 0)
+	    failed++;
+	else
+	    total_secs += secs;
+	SDL_AtomicUnlock(&total_lock);
+	if (secs >= 0)
+	    printf("%s: %.1f s in %.2f s, rtf %.4f, peak polyphony %d\n",
+		   jobs[i].name, secs, wall, secs > 0 ? wall / secs : 0.0,
+		   poly);
+    }
+    free(song);
+    return 0;
+}
+
+/* render files, or the midi files in any directories among them, to
+   dir as fast as renderthreads threads (default one per core) can go */
+int batch_render(char *dir, int nfiles, char **files)
+{
+    Uint64 t0 = SDL_GetPerformanceCounter();
+    SDL_Thread **thread;
+    struct sfSFBK *sf2;
+    int i, n;
+    double wall;
+
+    outdir = dir;
+    for (i = 0; i < nfiles; i++)
+	add_path(files[i], 1, 0);
+    if (njobs == 0) {
+	fprintf(stderr, "no midi files to render\n");
+	return 1;
+    }
+    if (mkdir(dir, 0777) == -1 && errno != EEXIST) {
+	perror(dir);
+	return 1;
+    }
+    name_outputs();
+    /* longest first, so no big file is left to finish on its own */
+    qsort(jobs, njobs, sizeof(struct batchjob), by_size);
+    /* keep a reference so the synths share one copy across files */
+    sf2 = load_sf2(sf2_filename);
+    n = renderthreads > 0 ? renderthreads : SDL_GetCPUCount();
+    if (n > njobs)
+	n = njobs;
+    if ((thread = calloc(n, sizeof(SDL_Thread *))) == NULL) {
+	perror("calloc");
+	return 1;
+    }
+    for (i = 0; i < n; i++)
+	if ((thread[i] = SDL_CreateThread(batch_worker, "batch render",
+					  NULL)) == NULL) {
+	    fprintf(stderr, "SDL_CreateThread: %s\n", SDL_GetError());
+	    break;
+	}
+    if ((n = i) == 0) {
+	batch_worker(NULL);	/* no threads at all, render them here */
+	n = 1;
+    }
+    while (i-- > 0)
+	SDL_WaitThread(thread[i], NULL);
+    free(thread);
+    release_sf2(sf2);
+    wall = (double) (SDL_GetPerformanceCounter() - t0) /
+	SDL_GetPerformanceFrequency();
+    printf("%d files, %.1f s of audio in %.2f s on %d threads, rtf %.4f",
+	   njobs - failed, total_secs, wall, n,
+	   total_secs > 0 ? wall / total_secs : 0.0);
+    if (failed)
+	printf(", %d failed", failed);
+    printf("\n");
+    return failed != 0;
+}
+/* end of file */
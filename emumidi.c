@@ -16,40 +16,50 @@
 #include <errno.h>
 #include <string.h>
 #include <math.h>
+#include <stdatomic.h>
+#include <stdint.h>
 
 #include "playmidi.h"
 
-/* fixme: these things should move inside a structure and include */
+/* player options, synth_new() copies the ones a synth can change */
 extern int play_ext;
-extern int chanmask, perc, dochan, MT32;
-extern Uint32 ticks;
-extern int useprog[16];
-extern char *sf2_filename;
-extern void seq_reset(int);
-extern void load_sf2(char *);
+extern int chanmask, perc, dochan, MT32, verbose, ctlrate, renderahead;
+extern int mixthreads, wavbits;
+extern char *stem_prefix, *audio_out;
+extern int useprog[16], usevol[16];
+extern float skew;
+extern void seq_reset(struct synth *, int);
+static void render_out(struct synth *, Uint64);
+extern void (*interp_cubic)(const short *, const float *, float *, int);
+extern void (*interp_cubic_f)(const float *, const float *, float *, int);
+extern char *interp_init(void);
+
+// where the soft synth output goes: something that pulls the audio out
+// of the synth at its own pace, which seq_wait() then follows, or else a
+// file, rendered by seq_wait() itself.  see backends[] below
+struct audio_backend {
+  char *name;
+  int (*open)(struct synth *);    // get ready to pull audio, or -1
+  void (*start)(struct synth *);  // start pulling, if not yet
+  void (*close)(struct synth *);  // no more pulling after this returns
+  void (*lock)(struct synth *);   // keep the puller off the synth state
+  void (*unlock)(struct synth *);
+};
+
+// file output, see synth_open_rw()
+static const struct audio_backend file_backend = { "file" };
 
 #define CHANNEL (dochan ? chn : 0)
 
-#define SAMPLELEN 512
 #define SAMPLERATE 96000
-#define PACKET_LIST_BYTES 65536
-#define POLYMAX 128
+#define PKT_VOICE(p) (&(p)->data[3])  // voice template after note on bytes
+/* largest packet, a note on carrying its voice template */
+#define PKT_MAX (sizeof(struct midi_packet) + 3 + sizeof(struct voicestate))
 #define NOTE_MAXLEN 0x7fffffff
+#define MIX_MINVOICES 8  // fewer active voices than this are mixed inline
+#define TAIL_MAXMS 5000  // longest an offline render rings out after the song
 
-static float rate = SAMPLERATE;
 int channels = 2;
-static SDL_AudioDeviceID sdl_dev = 0;
-
-static Uint8 pdata[PACKET_LIST_BYTES];  // space for queued midi events
-struct midi_packet *tseq = (void *)pdata;  // queued midi events to play
-struct midi_packet *tseqh = (void *)pdata;  // enqueue position in above
-struct midi_packet *tseqt = (void *)pdata;  // dequeue position in above
-
-struct voicestate voice[POLYMAX];  // active voices, samples = 0 = inactive
-struct chanstate channel[16];  // presently active channel state
-Uint64 samplepos = 0;  // current position in the sample output
-float atune = 440.0;  // this will affect all midi note conversions
-static float scaletune[16][12];  // 16 channels of tuning adjust
 
 // convert a negative cB value to linear 0 - 1.0
 float cB_to_linear(float cB)
@@ -61,9 +71,9 @@ float cB_to_linear(float cB)
 }
 
 // convert a floating point frequency to intger midi note number
-Uint8 freq_to_note(float freq)
+Uint8 freq_to_note(struct synth *syn, float freq)
 {
-  float d = 69 + 12 * log2(freq / atune);
+  float d = 69 + 12 * log2(freq / syn->atune);
   return (Uint8) d;
 }
 
@@ -74,11 +84,11 @@ float cents_to_freqmult(float cents, Uint16 num, Uint16 den)
 }
 
 // convert a midi note number to floating point frequency
-float note_to_freq(Uint8 note, Uint16 centsperkey, int ch)
+float note_to_freq(struct synth *syn, Uint8 note, Uint16 centsperkey, int ch)
 {
   float freq = pow(2, ((float)(note) - 69.0) *
-        (float) centsperkey / 1200.0) * atune;
-  freq *= scaletune[ch][note % 12];
+        (float) centsperkey / 1200.0) * syn->atune;
+  freq *= syn->scaletune[ch][note % 12];
   return freq;
 }
 
@@ -95,35 +105,45 @@ float pitchbend_to_freqmult(Uint16 pitchbend, Uint16 rpn0)
   return mult;
 }
 
-void apply_generators(int min, int max, void *g, int j)
+// sample address addr moved by offset frames, kept within lo to hi
+static Uint32 clamp_addr(Uint32 addr, int offset, Uint32 lo, Uint32 hi)
+{
+  Sint64 a = (Sint64)addr + offset;
+
+  return a < lo ? lo : a > hi ? hi : a;
+}
+
+// apply generators min to max of g, every one of a region in one call, to vs.
+// g is the merged list of the zone map, so add_gens() has already left out
+// the preset generators not valid at that level.  it belongs to the shared
+// soundfont, so out of range values are clamped in locals, never written back
+void apply_generators(struct synth *syn, int min, int max, const void *g,
+                      struct voicestate *vs)
 {
-  // static values are reinitialized after applying the final generators
-  static int newnote = -1;
-  static int coarseTune = 0, fineTune = 0, scaleTuning = 100;
-  static int sOff = 0, eOff = 0, sLoopOff = 0, eLoopOff = 0;
-  struct sfGenList *gen = g;
-  int p, preset_level = (g == sf2.pgen);
+  struct sfSFBK *sf2 = syn->sf2;
+  // sf2 defaults, the region's generators add to or replace them
+  int newnote = -1;
+  int coarseTune = 0, fineTune = 0, scaleTuning = 100;
+  int sOff = 0, eOff = 0, sLoopOff = 0, eLoopOff = 0;
+  int amount;
+  const struct sfGenList *gen = g;
+  int p;
 
   for (p = min; p < max; p++) {
     switch (gen[p].sfGenOper) {
       case SFG_startAddrsOffset:
-        if (preset_level) break;  // not valid at this level
         sOff += gen[p].genAmount.shAmount;
         break;
       case SFG_endAddrsOffset:
-        if (preset_level) break;  // not valid at this level
         eOff += gen[p].genAmount.shAmount;
         break;
       case SFG_startloopAddrsOffset:
-        if (preset_level) break;  // not valid at this level
         sLoopOff += gen[p].genAmount.shAmount;
         break;
       case SFG_endloopAddrsOffset:
-        if (preset_level) break;  // not valid at this level
         eLoopOff += gen[p].genAmount.shAmount;
         break;
       case SFG_startAddrsCoarseOffset:
-        if (preset_level) break;  // not valid at this level
         sOff += gen[p].genAmount.shAmount * 32768;
         break;
       case SFG_modLfoToPitch:
@@ -153,7 +173,7 @@ void apply_generators(int min, int max, void *g, int j)
           pan /= 500.0;     // new range -1.0 to 1.0
           pan += 1.0;       // new range  0.0 to 2.0
           pan /= 2.0;       // new range  0.0 to 1.0
-          voice[j].pan = pan;
+          vs->pan = pan;
         }
         break;
       case SFG_delayModLFO:
@@ -181,65 +201,60 @@ void apply_generators(int min, int max, void *g, int j)
       case SFG_keynumToModEnvDecay:
         break;
       case SFG_delayVolEnv:
-        voice[j].timestamp += rate *
+        vs->timestamp += syn->rate *
           cents_to_freqmult(gen[p].genAmount.shAmount, 1, 1);
         break;
       case SFG_attackVolEnv:
-        voice[j].env.a = rate *
+        vs->env.a = syn->rate *
           cents_to_freqmult(gen[p].genAmount.shAmount, 1, 1);
         break;
       case SFG_holdVolEnv:
-        voice[j].env.h = rate *
+        vs->env.h = syn->rate *
           cents_to_freqmult(gen[p].genAmount.shAmount, 1, 1);
         break;
       case SFG_decayVolEnv:
-        voice[j].env.d = rate *
+        vs->env.d = syn->rate *
           cents_to_freqmult(gen[p].genAmount.shAmount, 1, 1);
         break;
       case SFG_sustainVolEnv:
-        if (gen[p].genAmount.shAmount > 1440) {
-          gen[p].genAmount.shAmount = 1440;
-        }
+        amount = SDL_min(gen[p].genAmount.shAmount, 1440);
         // values less than zero are effectively zero with no decay time
-        if (gen[p].genAmount.shAmount <= 0) {
-          voice[j].env.d = 0;
-          voice[j].env.s = 1.0;
+        if (amount <= 0) {
+          vs->env.d = 0;
+          vs->env.s = 1.0;
         } else {
-          voice[j].env.s = cB_to_linear(0 - (float)gen[p].genAmount.shAmount);
+          vs->env.s = cB_to_linear(0 - (float)amount);
         }
         break;
       case SFG_releaseVolEnv:
-        voice[j].env.r = rate *
+        vs->env.r = syn->rate *
           cents_to_freqmult(gen[p].genAmount.shAmount, 1, 1);
         break;
       case SFG_keynumToVolEnvHold:
-        voice[j].env.h *=
-          cents_to_freqmult((float)(60 - voice[j].note) *
+        vs->env.h *=
+          cents_to_freqmult((float)(60 - vs->note) *
                 (float)gen[p].genAmount.shAmount, 1, 1);
         break;
       case SFG_keynumToVolEnvDecay:
-        voice[j].env.d *=
-          cents_to_freqmult((float)(60 - voice[j].note) *
+        vs->env.d *=
+          cents_to_freqmult((float)(60 - vs->note) *
                 (float)gen[p].genAmount.shAmount, 1, 1);
         break;
       case SFG_startloopAddrsCoarseOffset:
         sLoopOff += gen[p].genAmount.shAmount * 32768;
         break;
       case SFG_keynum:
-        if (preset_level) break;  // not valid at this level
-        voice[j].note = gen[p].genAmount.wAmount;
+        if (gen[p].genAmount.wAmount > 127) break;  // voices index by note
+        vs->note = gen[p].genAmount.wAmount;
         break;
       case SFG_velocity:
-        voice[j].v = (float)gen[p].genAmount.wAmount / 127.0;
+        vs->v = (float)gen[p].genAmount.wAmount / 127.0;
         break;
       case SFG_initialAttenuation:
-        if (gen[p].genAmount.wAmount > 1440) {
-          gen[p].genAmount.wAmount = 1440;
-        }
-        voice[j].v *= cB_to_linear(0 - (float)gen[p].genAmount.wAmount);
+        amount = SDL_min(gen[p].genAmount.wAmount, 1440);
+        vs->v *= cB_to_linear(0 - (float)amount);
         break;
       case SFG_endloopAddrsCoarseOffset:
-        if (preset_level) break;  // not valid at this level
         eLoopOff += gen[p].genAmount.shAmount * 32768;
         break;
       case SFG_coarseTune:
@@ -249,499 +264,1150 @@ void apply_generators(int min, int max, void *g, int j)
         fineTune = gen[p].genAmount.shAmount;
         break;
       case SFG_sampleModes:
-        if (preset_level) break;  // not valid at this level
-        voice[j].s.sampleModes = gen[p].genAmount.wAmount;
+        vs->s.sampleModes = gen[p].genAmount.wAmount;
         break;
       case SFG_scaleTuning:
         scaleTuning = gen[p].genAmount.wAmount;
         break;
       case SFG_exclusiveClass:
-        if (preset_level) break;  // not valid at this level
-        voice[j].exclusive_class = gen[p].genAmount.wAmount;
+        vs->exclusive_class = gen[p].genAmount.wAmount;
         break;
       case SFG_overridingRootKey:
-        if (preset_level) break;  // not valid at this level
         newnote = gen[p].genAmount.shAmount;
         break;
       default:
         break;
     }
   }
-  if (voice[j].shdr >= 0) {
-    int s = voice[j].shdr;
-    int ch = voice[j].channel;
+  if (vs->shdr >= 0 && sf2->smpl_size < sizeof(short)) {
+    vs->shdr = -1;  // no sample data to play
+  }
+  if (vs->shdr >= 0) {
+    int s = vs->shdr;
+    int ch = vs->channel;
+    // the offsets may not move any point out of the sample, nor the
+    // sample out of the sample data, or the taps would read past smpl
+    Uint32 hi = SDL_min(sf2->shdr[s].dwEnd,
+                        sf2->smpl_size / sizeof(short) - 1);
+    Uint32 lo = SDL_min(sf2->shdr[s].dwStart, hi);
     // finalize application of generator values
-    voice[j].s.dwStart = sf2.shdr[s].dwStart + sOff;
-    voice[j].s.dwEnd = sf2.shdr[s].dwEnd + eOff;
-    voice[j].s.dwStartloop = sf2.shdr[s].dwStartloop + sLoopOff;
-    voice[j].s.dwEndloop = sf2.shdr[s].dwEndloop + eLoopOff;
-    voice[j].f = note_to_freq(voice[j].note, scaleTuning, ch);
-    voice[j].r = voice[j].f / note_to_freq(newnote < 0 ?
-        sf2.shdr[s].byOriginalKey : newnote, scaleTuning, ch) *
-        ((float)sf2.shdr[s].dwSampleRate / rate);
-    voice[j].r *= cents_to_freqmult(coarseTune * 100.0, 1, 1);
-    voice[j].r *= cents_to_freqmult(fineTune, 1, 1);
-    voice[j].r *= cents_to_freqmult(sf2.shdr[s].chCorrection, 1, 1);
-    if (voice[j].exclusive_class) {
-      for (s = 0; s < POLYMAX; s++) {
-        if (s != j && voice[s].channel == ch &&
-            voice[s].exclusive_class == voice[j].exclusive_class) {
-          voice[j].endstamp = samplepos + voice[j].env.r;
-        }
-      }
-    }
-    // reinitialize static generator values to sf2 defaults
-    newnote = -1; coarseTune = 0; fineTune = 0; scaleTuning = 100;
-    sOff = 0; eOff = 0; sLoopOff = 0; eLoopOff = 0;
+    vs->s.dwStart = clamp_addr(sf2->shdr[s].dwStart, sOff, lo, hi);
+    vs->s.dwEnd = clamp_addr(sf2->shdr[s].dwEnd, eOff, lo, hi);
+    vs->s.dwStartloop = clamp_addr(sf2->shdr[s].dwStartloop, sLoopOff, lo, hi);
+    vs->s.dwEndloop = clamp_addr(sf2->shdr[s].dwEndloop, eLoopOff, lo, hi);
+    vs->s.dwStartloop = SDL_min(vs->s.dwStartloop, vs->s.dwEndloop);
+    vs->f = note_to_freq(syn, vs->note, scaleTuning, ch);
+    vs->r = vs->f / note_to_freq(syn, newnote < 0 ?
+        sf2->shdr[s].byOriginalKey : newnote, scaleTuning, ch) *
+        ((float)sf2->shdr[s].dwSampleRate / syn->rate);
+    vs->r *= cents_to_freqmult(coarseTune * 100.0, 1, 1);
+    vs->r *= cents_to_freqmult(fineTune, 1, 1);
+    vs->r *= cents_to_freqmult(sf2->shdr[s].chCorrection, 1, 1);
   }
 }
 
-struct midi_packet *next_pkt(struct midi_packet *p)
+struct midi_packet *next_pkt(struct synth *syn, struct midi_packet *p)
 {
   p = (struct midi_packet *)&(p)->data[(p)->len];
-  if ((Uint8 *)p >
-      pdata + PACKET_LIST_BYTES - (sizeof(struct midi_packet) + 5)) {
-    p = tseq;  /* wrap around to start of buffer */
+  if ((Uint8 *)p > syn->pdata + PACKET_LIST_BYTES - PKT_MAX) {
+    p = (void *)syn->pdata;  /* wrap around to start of buffer */
   }
   return p;
 }
 
-static struct midi_packet *add_pkt(struct midi_packet *p)
+// nonzero if a packet of any size fits at p without reaching the tail
+static int pkt_room(struct synth *syn, struct midi_packet *p)
 {
+  Uint8 *t = (Uint8 *)atomic_load_explicit(&syn->tseqt, memory_order_acquire);
+
+  return t < (Uint8 *)p || t - (Uint8 *)p > PKT_MAX;
+}
+
+// packet at the head of the queue for the producer to fill in
+static struct midi_packet *seq_pkt(struct synth *syn)
+{
+  return atomic_load_explicit(&syn->tseqh, memory_order_relaxed);
+}
+
+// queue packet p, filled in at the head, for the audio callback
+static void add_pkt(struct synth *syn, struct midi_packet *p)
+{
+  struct midi_packet *next;
+  unsigned int depth;
+
   /* timestamp is in samples since start of output */
-  p->timestamp = ticks * rate / 1000.0;
+  p->timestamp = syn->songpos + (Uint64)(syn->ticks * syn->rate / 1000.0);
   if (ISMIDI((p->data[0] & 0xf))) {
     midi_add_pkt(p);
-    return p;
-  }
-  p = next_pkt(p);
-  /* make sure there is room for at least one more 5 byte midi packet */
-  if ((Uint8 *)p >
-      pdata + PACKET_LIST_BYTES - (sizeof(struct midi_packet) + 5)) {
-    p->len = 0;  /* mark last packet before wrap around */
-    p = tseq;  /* wrap around to start of buffer */
-  }
-  /* if head reaches tail after adding, buffer is full but looks empty */
-  if (p == tseqt) {
-    fprintf(stderr, "midi packet buffer too small\n");
-    exit(1);
+    return;
   }
-  return p;
+  next = next_pkt(syn, p);
+  /* queue full: wait for the audio callback to play some of it */
+  while (!pkt_room(syn, next)) {
+    if (syn->out && syn->out_failed) {
+      return;  /* the output is gone, nothing will play it */
+    }
+    if (syn->out) {
+      render_out(syn, syn->samplepos + SAMPLELEN);  /* or play it ourselves */
+      continue;
+    }
+    if (!syn->backend) {
+      return;  /* nothing is draining the queue, drop the event */
+    }
+    SDL_Delay(1);
+  }
+  depth = atomic_fetch_add_explicit(&syn->pkts_in, 1, memory_order_relaxed) +
+          1 - atomic_load_explicit(&syn->pkts_out, memory_order_relaxed);
+  if (depth > syn->pkts_peak) {
+    syn->pkts_peak = depth;
+  }
+  atomic_store_explicit(&syn->tseqh, next, memory_order_release);
 }
 
-// fill_audio(): callback that will fill supplied buffer with audio data
-// udata: parameter supplied in SDL_AudioSpec userdata field
-// stream: pointer to the audio data buffer to be filled
-// len: the length of that buffer in bytes
-void fill_audio(void *udata, Uint8 *stream, int len)
+// song time in ms reached by the soft synth output, or by the wall clock
+// when there is no audio output to follow
+static Uint32 seq_clock(struct synth *syn)
 {
-  float vmod;  // volume mod for ADSR implementation
-  static float tlfo = 0.0;
-  static float rlfo = 0.0;
-  float left, right, lfo;
-  int i, j, ch, pgm, voices;
-  int nindex_max = len;  /* index of sample with the maximum value in window */
-  static float max_val = 0.0;  /* actual max sample value in window */
-  static float normalize = 1.0;
-  float *f32s = (float *)stream;
-  len >>= 3; // convert from bytes to samples
+  if (!syn->backend) {
+    return SDL_GetTicks() - syn->songtick;
+  }
+  return (atomic_load_explicit(&syn->playpos, memory_order_relaxed) -
+          syn->songpos) * 1000 / syn->rate;
+}
+
+// sleep towards song time ms being no more than ahead ms past the output
+// clock, for at most 10 ms so the caller can keep polling keys, or when
+// rendering to a file, render the output up to there.  returns nonzero
+// while the output clock is still behind
+int seq_wait(struct synth *syn, Uint32 ms, Uint32 ahead)
+{
+  Sint32 d;
 
-  if (rlfo == 0) {
-    rlfo = 2.0 * M_PI * 8.176 / rate; // 8.176hz lfo by default
+  if (syn->out) {
+    if (ms > ahead) {
+      render_out(syn, syn->songpos +
+                 (Uint64)((ms - ahead) * syn->rate / 1000.0));
+    }
+    return 0;
   }
-  for (i = 0; i < len; i++) {
-    // triangle
-    lfo = fabs(0.3184 * (tlfo - M_PI)) - 1.0;
-    //lfo = sin(tlfo);
-    tlfo += rlfo;
-    if (tlfo > 2 * M_PI) {
-      tlfo -= 2 * M_PI;
+  if ((d = (Sint32)(ms - ahead - seq_clock(syn))) <= 0) {
+    return 0;
+  }
+  SDL_Delay(SDL_min(d, 10));
+  return 1;
+}
+
+// number of packets waiting to be played, peak gets the most ever waiting
+int seq_queue_depth(struct synth *syn, int *peak)
+{
+  if (peak) {
+    *peak = syn->pkts_peak;
+  }
+  return atomic_load_explicit(&syn->pkts_in, memory_order_relaxed) -
+         atomic_load_explicit(&syn->pkts_out, memory_order_relaxed);
+}
+
+// chan_preset(): find the sf2 preset for the program and bank of channel
+// ch at the end of the queue, called whenever one of them or the
+// percussion mask changes so note ons can reuse the result
+static void chan_preset(struct synth *syn, int ch)
+{
+  struct sfSFBK *sf2 = syn->sf2;
+  int p, bank, count, pgm, phdr = 0;
+
+  if (!sf2) {
+    return;
+  }
+  pgm = syn->seqchan[ch].program;
+  bank = syn->seqchan[ch].controller[CTL_BANK_SELECT];
+  bank <<= 7;
+  bank |= syn->seqchan[ch].controller[CTL_BANK_SELECT + CTL_LSB];
+  if (bank == 128) {
+    bank = 0; /* soundfonts use bank 128 for percussion */
+  }
+  if (SYNPERC(syn, ch)) {
+    bank = 128; /* soundfonts use bank 128 for percussion */
+  }
+  // find the preset that matches the program
+  count = sf2->phdr_size / sizeof(struct sfPresetHeader);
+  for (p = 0; p + 1 < count; p++) {
+    if (sf2->phdr[p].wBank == bank && bank == 128 &&
+      sf2->phdr[p].wPreset <= pgm) {
+      phdr = p; /* default to first percussion match */
     }
-    while (tseqh != tseqt && tseqt->timestamp <= samplepos) {
-      /* found midi event starting at this sample position to process */
-      int cmd = tseqt->data[0];
-      ch = cmd & 0xf;
-      switch (cmd & 0xf0) {
-        case MIDI_NOTEOFF:
-          for (j = 0; j < POLYMAX; j++) {
-            if (voice[j].channel == ch && voice[j].note == tseqt->data[1] &&
-                voice[j].endstamp == NOTE_MAXLEN) {
-              if (channel[ch].controller[CTL_SUSTAIN] >= 64) {
-                voice[j].sustain = 1;
-                continue;
-              }
-              voice[j].endstamp = samplepos + voice[j].env.r;
-              if (voice[j].s.sampleModes != 1) {
-                voice[j].s.sampleModes = 0;  // tell voice to finish past loop
-              }
-            }
-          }
-          break;
-        case MIDI_NOTEON:
-          /* find an empty voice to use for note start */
-          pgm = POLYMAX;
-          for (j = 0; j < POLYMAX; j++) {
-            if (voice[j].channel == ch && voice[j].note == tseqt->data[1] &&
-                voice[j].endstamp == NOTE_MAXLEN) {
-              /* stop any existing playing voice on the same note/chan */
-              voice[j].endstamp = samplepos + voice[j].env.r;
-              if (voice[j].s.sampleModes != 1) {
-                voice[j].s.sampleModes = 0;  // tell voice to finish past loop
-              }
-            }
-            if (voice[j].endstamp < samplepos) {
-              pgm = j;
-            }
-          }
-          if (j < 0)
-            break;
-          j = pgm;
-          if (j >= POLYMAX) {  /* steal oldest voice if none free */
-            Uint64 oldest = ~0;
-            int jold = j;
-            for (j = 0; j < POLYMAX; j++) {
-              if (voice[j].timestamp < oldest) {
-                oldest = voice[j].timestamp;
-                jold = j;
-              }
-            }
-            j = jold;
-          }
-          if (j < POLYMAX) {
-            memset(&voice[j], 0, sizeof(voice[j]));
-            voice[j].note = tseqt->data[1];
-            voice[j].f = note_to_freq(voice[j].note, 100, ch);
-            voice[j].r = 2 * M_PI * voice[j].f / rate;
-            voice[j].vel = tseqt->data[2];
-            voice[j].v = (float)tseqt->data[2] / 128.0;
-            voice[j].t = 0.0;
-            voice[j].env.a = cents_to_freqmult(-12000, 1, 1) * rate;
-            voice[j].env.h = voice[j].env.a;
-            voice[j].env.d = voice[j].env.a;
-            voice[j].env.s = 1.0;
-            voice[j].env.r = voice[j].env.a;
-            voice[j].pan = (float)channel[ch].controller[CTL_PAN] / 127.0;
-            voice[j].channel = ch;
-            voice[j].endstamp = NOTE_MAXLEN;  // set at noteoff event
-            voice[j].timestamp = samplepos;
-            voice[j].inst = -1;  // not found
-            voice[j].shdr = -1;  // not found
-            if (sf2.shdr) {
-              int p, zone, bank, count, range, velrange;
-              int vel = voice[j].vel;
-              pgm = channel[ch].program;
-              bank = channel[ch].controller[CTL_BANK_SELECT];
-              bank <<= 7;
-              bank |= channel[ch].controller[CTL_BANK_SELECT + CTL_LSB];
-              if (bank == 128) {
-                bank = 0; /* soundfonts use bank 128 for percussion */
-              }
-              if (ISPERC(ch)) {
-                bank = 128; /* soundfonts use bank 128 for percussion */
-              }
-              // find the preset that matches the program
-              count = sf2.phdr_size / sizeof(struct sfPresetHeader);
-              for (p = 0; p + 1 < count; p++) {
-                if (sf2.phdr[p].wBank == bank && bank == 128 &&
-                  sf2.phdr[p].wPreset <= pgm) {
-                  voice[j].phdr = p; /* default to first percussion match */
-                }
-                if (sf2.phdr[p].wPreset == pgm) {
-                  if (sf2.phdr[p].wBank == 0 && bank != 128) {
-                    voice[j].phdr = p; /* default to bank 0 match */
-                  }
-                  if (sf2.phdr[p].wBank == bank) {
-                      break;
-                  }
-                }
-              }
-              if (p + 1 < count) {
-                voice[j].phdr = p;
-              }
-              voice[j].pbag = sf2.phdr[voice[j].phdr].wPresetBagNdx;
-              voice[j].pbag_max = sf2.phdr[voice[j].phdr + 1].wPresetBagNdx;
-              for (zone = voice[j].pbag; zone < voice[j].pbag_max; zone++) {
-                voice[j].pgen = sf2.pbag[zone].wGenNdx;
-                voice[j].pmod = sf2.pbag[zone].wModNdx;
-                voice[j].pgen_max = sf2.pbag[zone + 1].wGenNdx;
-                voice[j].pmod_max = sf2.pbag[zone + 1].wModNdx;
-                range = velrange = 1;
-                for (p = voice[j].pgen; p < voice[j].pgen_max; p++) {
-                  if (sf2.pgen[p].sfGenOper == SFG_keyRange) {
-                    if (sf2.pgen[p].genAmount.ranges.byLo <= voice[j].note &&
-                        sf2.pgen[p].genAmount.ranges.byHi >= voice[j].note) {
-                      range = 1;
-                    } else {
-                      range = 0;
-                    }
-                  }
-                  if (sf2.pgen[p].sfGenOper == SFG_velRange) {
-                    if (sf2.pgen[p].genAmount.ranges.byLo <= vel &&
-                        sf2.pgen[p].genAmount.ranges.byHi >= vel) {
-                      velrange = 1;
-                    } else {
-                      velrange = 0;
-                    }
-                  }
-                  if (sf2.pgen[p].sfGenOper == SFG_instrument) {
-                    if (range && velrange) {
-                      voice[j].inst = sf2.pgen[p].genAmount.wAmount;
-                      apply_generators(voice[j].pgen, voice[j].pgen_max,
-                                       sf2.pgen, j);
-                    }
-                    break; // instrument is terminal for zone
-                  }
-                }
-                if (zone == voice[j].pgen && p == voice[j].pgen_max) {
-                  // apply global zone generotors
-                  apply_generators(voice[j].pgen, voice[j].pgen_max,
-                                   sf2.pgen, j);
-                }
-                if (voice[j].inst >= 0) {
-                  break;  // found relevant zone
-                }
-              }
-              if (voice[j].inst < 0) {
-                // failed to find suitable instrument
-                // ibag/ibag_max were memset to 0 earlier
-                // for loop below will exit early
-              } else {
-                voice[j].ibag = sf2.inst[voice[j].inst].wInstBagNdx;
-                voice[j].ibag_max = sf2.inst[voice[j].inst + 1].wInstBagNdx;
-              }
-              for (zone = voice[j].ibag; zone < voice[j].ibag_max; zone++) {
-                voice[j].igen = sf2.ibag[zone].wInstGenNdx;
-                voice[j].imod = sf2.ibag[zone].wInstModNdx;
-                voice[j].igen_max = sf2.ibag[zone + 1].wInstGenNdx;
-                voice[j].imod_max = sf2.ibag[zone + 1].wInstModNdx;
-                range = velrange = 1;
-                for (p = voice[j].igen; p < voice[j].igen_max; p++) {
-                  if (sf2.igen[p].sfGenOper == SFG_keyRange) {
-                    if (sf2.igen[p].genAmount.ranges.byLo <= voice[j].note &&
-                        sf2.igen[p].genAmount.ranges.byHi >= voice[j].note) {
-                      range = 1;
-                    } else {
-                      range = 0;
-                    }
-                  }
-                  if (sf2.igen[p].sfGenOper == SFG_velRange) {
-                    if (sf2.igen[p].genAmount.ranges.byLo <= vel &&
-                        sf2.igen[p].genAmount.ranges.byHi >= vel) {
-                      velrange = 1;
-                    } else {
-                      velrange = 0;
-                    }
-                  }
-                  if (sf2.igen[p].sfGenOper == SFG_sampleID) {
-                    if (range && velrange) {
-                      voice[j].shdr = sf2.igen[p].genAmount.wAmount;
-                      apply_generators(voice[j].igen, voice[j].igen_max,
-                                       sf2.igen, j);
-                    }
-                    break; // instrument is terminal for zone
-                  }
-                }
-                if (zone == voice[j].igen && p == voice[j].igen_max) {
-                  // apply global zone generotors
-                  apply_generators(voice[j].igen, voice[j].igen_max,
-                                   sf2.igen, j);
-                }
-                if (voice[j].shdr >= 0) {
-                  break;  // found relevant zone
-                }
-              }
-              if (voice[j].shdr < 0) {
-                /* failed to find suitable sampleID, free voice */
-                voice[j].endstamp = 0;
-              }
-            } else {
-              if (ISPERC(ch)) {
-                /* kill percussion for non-sf2 voice */
-                voice[j].endstamp = 0;
-              }
-              voice[j].env.r = rate/16;
-              voice[j].env.d = rate/16;
-              voice[j].env.s = 0.4;
-              voice[j].env.a = rate/64;
-            }
-          }
-          break;
-        case MIDI_KEY_PRESSURE:
-          // todo: find voice, do something to it
+    if (sf2->phdr[p].wPreset == pgm) {
+      if (sf2->phdr[p].wBank == 0 && bank != 128) {
+        phdr = p; /* default to bank 0 match */
+      }
+      if (sf2->phdr[p].wBank == bank) {
           break;
-        case MIDI_CTL_CHANGE:
-          channel[ch].controller[tseqt->data[1]] = tseqt->data[2];
-          /* handle RPN/NRPN */
-          if (tseqt->data[1] == CTL_DATA_ENTRY) {
-             if (channel[ch].controller[CTL_RPN_LSB] == 0 &&
-                 channel[ch].controller[CTL_RPN_MSB] == 0) {
-                channel[ch].bender_range = tseqt->data[2];
-            }
-          }
-          if (tseqt->data[1] == CTL_MODWHEEL) {
-            channel[ch].mod_mult =
-                cents_to_freqmult(47, tseqt->data[2], 127) - 1.0;
-          }
-          if (tseqt->data[1] == CTL_SUSTAIN && tseqt->data[2] < 64) {
-            for (j = 0; j < POLYMAX; j++) {
-              if (voice[j].channel == ch && voice[j].sustain) {
-                voice[j].sustain = 0;
-                voice[j].endstamp = samplepos + voice[j].env.r;
-                if (voice[j].s.sampleModes != 1) {
-                  voice[j].s.sampleModes = 0;  // finish past loop
-                }
-              }
-            }
+      }
+    }
+  }
+  if (p + 1 < count) {
+    phdr = p;
+  }
+  syn->seqchan[ch].phdr = phdr;
+}
+
+// float cache entry usable by a new voice, NULL if generators moved the
+// end or loop points away from the ones the cache was built for.  the
+// entry is filled here, on the producer side, so the audio thread never
+// converts samples or waits for another synth doing it
+static struct sfCache *voice_cache(struct synth *syn, struct voicestate *vs)
+{
+  struct sfSFBK *sf2 = syn->sf2;
+  struct sfCache *c;
+  struct sfSample *h;
+
+  if (!sf2 || !sf2->cache || vs->shdr < 0 || !sf2->cache[vs->shdr].data) {
+    return NULL;
+  }
+  c = &sf2->cache[vs->shdr];
+  h = &sf2->shdr[vs->shdr];
+  if (vs->s.dwStart < h->dwStart || vs->s.dwStart >= h->dwEnd ||
+      vs->s.dwEnd != h->dwEnd) {
+    return NULL;
+  }
+  if ((vs->s.sampleModes & 1) && (!c->loop ||
+      vs->s.dwStartloop != h->dwStartloop || vs->s.dwEndloop != h->dwEndloop)) {
+    return NULL;
+  }
+  return cache_sample(sf2, vs->shdr);
+}
+
+// voice_setup(): resolve the sf2 preset and zones for a new note into a
+// voice template, on the producer side so the audio thread only has to
+// copy it.  uses the channel state as of the end of the queue (seqchan)
+static void voice_setup(struct synth *syn, struct voicestate *vs, int ch,
+                        int note, int vel)
+{
+  struct sfSFBK *sf2 = syn->sf2;
+
+  memset(vs, 0, sizeof(*vs));
+  vs->note = note;
+  vs->f = note_to_freq(syn, vs->note, 100, ch);
+  vs->r = 2 * M_PI * vs->f / syn->rate;
+  vs->vel = vel;
+  vs->v = (float)vel / 128.0;
+  vs->t = 0.0;
+  vs->env.a = cents_to_freqmult(-12000, 1, 1) * syn->rate;
+  vs->env.h = vs->env.a;
+  vs->env.d = vs->env.a;
+  vs->env.s = 1.0;
+  vs->env.r = vs->env.a;
+  vs->pan = (float)syn->seqchan[ch].controller[CTL_PAN] / 127.0;
+  vs->channel = ch;
+  vs->endstamp = NOTE_MAXLEN;  // set at noteoff event
+  vs->timestamp = 0;  // start delay, made absolute at note on
+  vs->shdr = -1;  // not found
+  if (sf2) {
+    int i;
+    vs->phdr = syn->seqchan[ch].phdr;
+    // first region of the preset that covers this key and velocity,
+    // none for a bad note number, which would index past zkey
+    if (sf2->zkey && note >= 0 && note < 128) {
+      Uint32 *zk = &sf2->zkey[vs->phdr * 129 + note];
+      for (i = zk[0]; i < zk[1]; i++) {
+        struct sfZone *z = &sf2->zone[sf2->zlist[i]];
+        if (z->vello <= vel && z->velhi >= vel) {
+          if (z->shdr >= 0) {
+            vs->shdr = z->shdr;
+            apply_generators(syn, z->gen, z->gen_max, sf2->zgen, vs);
+            vs->cache = voice_cache(syn, vs);
           }
           break;
-        case MIDI_PGM_CHANGE:
-          channel[ch].program = tseqt->data[1];
-          break;
-        case MIDI_CHN_PRESSURE:
-          channel[ch].pressure = tseqt->data[1];
-          break;
-        case MIDI_PITCH_BEND:
-          channel[ch].bender = tseqt->data[2];
-          channel[ch].bender <<= 7;
-          channel[ch].bender |= tseqt->data[1];
-          channel[ch].bender_mult = pitchbend_to_freqmult(channel[ch].bender,
-                channel[ch].bender_range);
-          break;
-        default:
-          fprintf(stderr, "\r(unhandled midi cmd = 0x%02x)\n", cmd);
-          exit(1);
+        }
       }
-      //memset(&tseqt->data[0], 0, tseqt->len); /* debug: kill off event data */
-      tseqt = next_pkt(tseqt);
     }
-    left = 0.0;
-    right = 0.0;
-    for (j = voices = 0; j < POLYMAX; j++) {
-      float sample, t;
-      int tpos, rpos;
-      if (voice[j].endstamp <= samplepos) {
-        continue;
-      }
-      voices++;
-      tpos = samplepos - voice[j].timestamp;  // sample # since attack start
-      rpos = voice[j].endstamp - samplepos; // release pos
-      t = voice[j].t;  // each voice has its own timebase
-      if (tpos < voice[j].env.a) {
-        // attack phase
-        vmod = (float)tpos / voice[j].env.a;
-      } else if (tpos < voice[j].env.a + voice[j].env.h) {
-        // hold phase
-        vmod = 1.0;
-      } else if (tpos < voice[j].env.a + voice[j].env.h + voice[j].env.d) {
-        // decay phase
-        vmod = ((float)tpos - (voice[j].env.a + voice[j].env.h)) /
-                voice[j].env.d;
-        vmod *= 1.0 - voice[j].env.s;
-        vmod = 1.0 - vmod;   // range from 1.0 down to env.s
-      } else {
-        // sustain phase
-        vmod = voice[j].env.s;
-        if (vmod <= 0.000001) {  // kill voice when it can't be heard anymore
-          voice[j].endstamp = 0;
-        }
+    if (vs->shdr < 0) {
+      /* failed to find suitable sampleID, free voice */
+      vs->endstamp = 0;
+    }
+  } else {
+    if (SYNPERC(syn, ch)) {
+      /* kill percussion for non-sf2 voice */
+      vs->endstamp = 0;
+    }
+    vs->env.r = syn->rate/16;
+    vs->env.d = syn->rate/16;
+    vs->env.s = 0.4;
+    vs->env.a = syn->rate/64;
+  }
+}
+
+// set up the voice pool with every slot idle
+static void voice_init(struct synth *syn)
+{
+  struct voicepool *pool = &syn->pool;
+  int i;
+
+  memset(&syn->pool, 0, sizeof(syn->pool));
+  for (i = 0; i < POLYMAX; i++) {
+    pool->idle[i] = POLYMAX - 1 - i;
+  }
+  pool->nidle = POLYMAX;
+  memset(pool->keyhead, -1, sizeof(pool->keyhead));
+  memset(pool->sushead, -1, sizeof(pool->sushead));
+  memset(pool->xhead, -1, sizeof(pool->xhead));
+}
+
+// push slot j on the front of a voice list
+static void link_slot(int *head, int *next, int *prev, int j)
+{
+  prev[j] = -1;
+  next[j] = *head;
+  if (*head >= 0) {
+    prev[*head] = j;
+  }
+  *head = j;
+}
+
+// take slot j out of a voice list
+static void unlink_slot(int *head, int *next, int *prev, int j)
+{
+  if (prev[j] >= 0) {
+    next[prev[j]] = next[j];
+  } else {
+    *head = next[j];
+  }
+  if (next[j] >= 0) {
+    prev[next[j]] = prev[j];
+  }
+}
+
+// take slot j out of every list it is on before it is reused
+static void voice_unlink(struct synth *syn, int j)
+{
+  struct voicepool *pool = &syn->pool;
+  int ch = pool->channel[j];
+
+  unlink_slot(&pool->keyhead[ch][pool->note[j]], pool->keynext, pool->keyprev,
+              j);
+  if (pool->sustain[j]) {
+    unlink_slot(&pool->sushead[ch], pool->susnext, pool->susprev, j);
+    pool->sustain[j] = 0;
+  }
+  if (pool->exclusive_class[j]) {
+    unlink_slot(&pool->xhead[ch], pool->xnext, pool->xprev, j);
+  }
+}
+
+// start the release phase of voice slot j
+static void voice_release(struct synth *syn, int j)
+{
+  struct voicepool *pool = &syn->pool;
+  if (pool->sustain[j]) {
+    unlink_slot(&pool->sushead[pool->channel[j]], pool->susnext, pool->susprev,
+                j);
+    pool->sustain[j] = 0;
+  }
+  pool->endstamp[j] = syn->samplepos + pool->env[j].r;
+  if (pool->s[j].sampleModes != 1) {
+    pool->s[j].sampleModes = 0;  // tell voice to finish past loop
+  }
+}
+
+// copy a voice setup record into a free voice slot, stealing if needed
+static void voice_start(struct synth *syn, struct voicestate *vs)
+{
+  struct voicepool *pool = &syn->pool;
+  int i, j;
+
+  if (vs->exclusive_class) {  /* new note stops held notes of its class */
+    for (j = pool->xhead[vs->channel]; j >= 0; j = pool->xnext[j]) {
+      if (pool->exclusive_class[j] == vs->exclusive_class &&
+          pool->endstamp[j] == NOTE_MAXLEN) {
+        voice_release(syn, j);
       }
-      if (rpos < voice[j].env.r) {
-        // release phase, go from calculated envelope position down to zero
-        // cubic decay, vmod *= (rpos/env.r)^3
-        float x = (float)rpos / voice[j].env.r;
-        vmod *= x * x * x;
+    }
+  }
+  if (vs->endstamp <= syn->samplepos) {
+    return;  /* nothing to play */
+  }
+  if (pool->nidle > 0) {
+    j = pool->idle[--pool->nidle];
+    pool->active[pool->nactive++] = j;
+    if (pool->nactive > syn->poly_peak) {
+      syn->poly_peak = pool->nactive;
+    }
+  } else {  /* steal oldest voice if none free */
+    Uint64 oldest = ~0;
+    j = pool->active[0];
+    for (i = 0; i < pool->nactive; i++) {
+      if (pool->timestamp[pool->active[i]] < oldest) {
+        oldest = pool->timestamp[pool->active[i]];
+        j = pool->active[i];
       }
-      ch = voice[j].channel;
-      pgm = channel[ch].program;
-      vmod *= (float)channel[ch].controller[CTL_MAIN_VOLUME] / 127.0;
-      vmod *= (float)channel[ch].controller[CTL_EXPRESSION] / 127.0;
-      if (voice[j].shdr < 0) {
-        pgm = -pgm - 2;  // do math based synthesis
-        if (t > 2 * M_PI) {
-          t -= 2 * M_PI;
-        }
-        if (t < 0) {
-          t += 2 * M_PI;
-        }
-      } else {
-        if ((voice[j].s.sampleModes & 1) &&
-            t + voice[j].s.dwStart >= voice[j].s.dwEndloop) {
-          t = voice[j].s.dwStartloop - voice[j].s.dwStart;
+    }
+    voice_unlink(syn, j);
+  }
+  pool->t[j] = vs->t;
+  pool->r[j] = vs->r;
+  pool->v[j] = vs->v;
+  pool->pan[j] = vs->pan;
+  pool->channel[j] = vs->channel;
+  pool->shdr[j] = vs->shdr;
+  pool->timestamp[j] = vs->timestamp;
+  pool->endstamp[j] = vs->endstamp;
+  pool->env[j] = vs->env;
+  pool->s[j] = vs->s;
+  pool->cache[j] = vs->cache;
+  pool->note[j] = vs->note;
+  pool->sustain[j] = 0;
+  pool->exclusive_class[j] = vs->exclusive_class;
+  link_slot(&pool->keyhead[vs->channel][vs->note], pool->keynext, pool->keyprev,
+            j);
+  if (vs->exclusive_class) {
+    link_slot(&pool->xhead[vs->channel], pool->xnext, pool->xprev, j);
+  }
+}
+
+// process_pkt(): apply one queued midi event to channel and voice state
+// pkt: packet at the tail of the queue, due at the current sample position
+static void process_pkt(struct synth *syn, struct midi_packet *pkt)
+{
+  struct voicepool *pool = &syn->pool;
+  struct voicestate vs;  // setup record for a new voice
+  int j, ch;
+  int cmd = pkt->data[0];
+
+  ch = cmd & 0xf;
+  if (((cmd & 0xf0) == MIDI_NOTEOFF || (cmd & 0xf0) == MIDI_NOTEON) &&
+      pkt->data[1] > 127) {
+    return;  // not a note, and keyhead has room for no more
+  }
+  switch (cmd & 0xf0) {
+    case MIDI_NOTEOFF:
+      for (j = pool->keyhead[ch][pkt->data[1]]; j >= 0; j = pool->keynext[j]) {
+        if (pool->endstamp[j] == NOTE_MAXLEN && !pool->sustain[j]) {
+          if (syn->channel[ch].controller[CTL_SUSTAIN] >= 64) {
+            pool->sustain[j] = 1;
+            link_slot(&pool->sushead[ch], pool->susnext, pool->susprev, j);
+            continue;
+          }
+          voice_release(syn, j);
         }
-        if (t + voice[j].s.dwStart >= voice[j].s.dwEnd) {
-          voice[j].endstamp = 0;  // kill off voice when completely played
+      }
+      break;
+    case MIDI_NOTEON:
+      for (j = pool->keyhead[ch][pkt->data[1]]; j >= 0; j = pool->keynext[j]) {
+        if (pool->endstamp[j] == NOTE_MAXLEN) {
+          /* stop any existing playing voice on the same note/chan */
+          voice_release(syn, j);
         }
       }
-      if (pgm <= -1) { // sine
-        sample = sin(t);
-      } else if (pgm < 0) {  // for all othe negative values be a minimoog
-        // morph between tri, saw, square, rect wave full negative pgm value
-        float tri, saw, squ;
-        float pwm = (lfo + 1.0) * 0.98;
-        tri = (fabs(0.3184 * (t - M_PI)) - 1.0);
-        saw = 0.3184 * (t - M_PI);
-        squ = (t > M_PI * pwm ? -1.0 : 1.0);
-        sample = saw; //squ * pwm + saw * (2.0 - pwm);
-      } else { // wavetable
-        int index = voice[j].s.dwStart + (int)t;
-        // cubic interpolate samples
-        // more info: http://paulbourke.net/miscellaneous/interpolation/
-        float mu = t - (int)t, mu2 = mu * mu;
-        float a0, a1, a2, a3;
-        float y0, y1, y2, y3;
-        y0 = (float)sf2.smpl[index++];
-        if ((voice[j].s.sampleModes & 1) && index >= voice[j].s.dwEndloop) {
-          index = voice[j].s.dwStartloop;
-        } else if (index > voice[j].s.dwEnd) {
-          index = voice[j].s.dwEnd;
+      /* the voice template was resolved when the event was queued */
+      memcpy(&vs, PKT_VOICE(pkt), sizeof(vs));
+      vs.timestamp += syn->samplepos;
+      voice_start(syn, &vs);
+      break;
+    case MIDI_KEY_PRESSURE:
+      // todo: find voice, do something to it
+      break;
+    case MIDI_CTL_CHANGE:
+      syn->channel[ch].controller[pkt->data[1]] = pkt->data[2];
+      /* handle RPN/NRPN */
+      if (pkt->data[1] == CTL_DATA_ENTRY) {
+         if (syn->channel[ch].controller[CTL_RPN_LSB] == 0 &&
+             syn->channel[ch].controller[CTL_RPN_MSB] == 0) {
+            syn->channel[ch].bender_range = pkt->data[2];
         }
-        y1 = (float)sf2.smpl[index++];
-        if ((voice[j].s.sampleModes & 1) && index >= voice[j].s.dwEndloop) {
-          index = voice[j].s.dwStartloop;
-        } else if (index > voice[j].s.dwEnd) {
-          index = voice[j].s.dwEnd;
+      }
+      if (pkt->data[1] == CTL_MODWHEEL) {
+        syn->channel[ch].mod_mult =
+            cents_to_freqmult(47, pkt->data[2], 127) - 1.0;
+      }
+      if (pkt->data[1] == CTL_SUSTAIN && pkt->data[2] < 64) {
+        while (pool->sushead[ch] >= 0) {
+          voice_release(syn, pool->sushead[ch]);
         }
-        y2 = (float)sf2.smpl[index++];
-        if ((voice[j].s.sampleModes & 1) && index >= voice[j].s.dwEndloop) {
-          index = voice[j].s.dwStartloop;
-        } else if (index > voice[j].s.dwEnd) {
-          index = voice[j].s.dwEnd;
+      }
+      break;
+    case MIDI_PGM_CHANGE:
+      syn->channel[ch].program = pkt->data[1];
+      break;
+    case MIDI_CHN_PRESSURE:
+      syn->channel[ch].pressure = pkt->data[1];
+      break;
+    case MIDI_PITCH_BEND:
+      syn->channel[ch].bender = pkt->data[2];
+      syn->channel[ch].bender <<= 7;
+      syn->channel[ch].bender |= pkt->data[1];
+      syn->channel[ch].bender_mult =
+          pitchbend_to_freqmult(syn->channel[ch].bender,
+                                syn->channel[ch].bender_range);
+      break;
+    default:
+      fprintf(stderr, "\r(unhandled midi cmd = 0x%02x)\n", cmd);
+      exit(1);
+  }
+  //memset(&pkt->data[0], 0, pkt->len); /* debug: kill off event data */
+}
+
+// samples from span position i to the next control rate update, at most n
+// updates fall on multiples of ctlrate in absolute sample position, so
+// they don't move when events split the output into different spans
+static int ctl_next(struct synth *syn, int i, int n)
+{
+  int next = ((syn->samplepos + i) / syn->ctlrate + 1) * syn->ctlrate -
+             syn->samplepos;
+  return next < n ? next : n;
+}
+
+// envelope and channel level of voice slot j, tpos samples after attack
+// start and rpos samples before the end of its release
+static float env_level(struct synth *syn, int j, int tpos, Sint64 rpos)
+{
+  struct voicepool *pool = &syn->pool;
+  struct voice_env *env = &pool->env[j];
+  int ch = pool->channel[j];
+  float vmod;  // volume mod for ADSR implementation
+
+  if (tpos < env->a) {
+    // attack phase
+    vmod = (float)tpos / env->a;
+  } else if (tpos < env->a + env->h) {
+    // hold phase
+    vmod = 1.0;
+  } else if (tpos < env->a + env->h + env->d) {
+    // decay phase
+    vmod = ((float)tpos - (env->a + env->h)) / env->d;
+    vmod *= 1.0 - env->s;
+    vmod = 1.0 - vmod;   // range from 1.0 down to env.s
+  } else {
+    // sustain phase
+    vmod = env->s;
+  }
+  if (rpos < env->r) {
+    // release phase, go from calculated envelope position down to zero
+    // cubic decay, vmod *= (rpos/env.r)^3
+    float x = (float)rpos / env->r;
+    vmod *= x * x * x;
+  }
+  vmod *= (float)syn->channel[ch].controller[CTL_MAIN_VOLUME] / 127.0;
+  vmod *= (float)syn->channel[ch].controller[CTL_EXPRESSION] / 127.0;
+  return vmod;
+}
+
+// fill level[] with envelope and channel level of voice slot j for up to
+// n samples from samplepos.  the level is evaluated at each control rate
+// update and at every envelope stage boundary, and interpolated linearly
+// in between, so only the cubic release is approximated.  returns the
+// number of samples that play, fewer than n if the voice ends or fades out
+static int voice_levels(struct synth *syn, int j, float *level, int n)
+{
+  struct voicepool *pool = &syn->pool;
+  struct voice_env *env = &pool->env[j];
+  int i, k, next, tpos = syn->samplepos - pool->timestamp[j];  // since attack
+  Sint64 rpos = pool->endstamp[j] - syn->samplepos;  // release pos
+  Sint64 rel = rpos - (Sint64)ceilf(env->r) + 1;  // start of release
+  int edge[4];  // span positions where the envelope changes shape
+  float l0, l1, dl;
+
+  if (rpos < n) {
+    n = rpos > 0 ? rpos : 0;
+  }
+  edge[0] = (int)ceilf(env->a) - tpos;                     // end of attack
+  edge[1] = (int)ceilf(env->a + env->h) - tpos;            // end of hold
+  edge[2] = (int)ceilf(env->a + env->h + env->d) - tpos;   // end of decay
+  edge[3] = rel < n ? rel : n;
+  if (env->s <= 0.000001 && edge[2] < n) {
+    // kill voice when it can't be heard anymore
+    pool->endstamp[j] = 0;
+    n = SDL_max(edge[2], 0) + 1;
+  }
+  l0 = env_level(syn, j, tpos, rpos);
+  for (i = 0; i < n; i = next) {
+    next = ctl_next(syn, i, n);
+    for (k = 0; k < 4; k++) {
+      if (edge[k] > i && edge[k] < next) {
+        next = edge[k];
+      }
+    }
+    l1 = env_level(syn, j, tpos + next, rpos - next);
+    dl = (l1 - l0) / (next - i);
+    for (k = i; k < next; k++) {
+      level[k] = l0 + dl * (k - i);
+    }
+    l0 = l1;
+  }
+  return n;
+}
+
+// fill step[] with the timebase advance of voice slot j for each of n
+// samples, from its pitch at each control rate update
+static void voice_steps(struct synth *syn, int j, float *lfo, double *step,
+                        int n)
+{
+  struct voicepool *pool = &syn->pool;
+  int i, k, next, ch = pool->channel[j];
+  float r = pool->r[j] * syn->channel[ch].bender_mult;
+  double s0, s1, ds;
+
+  s0 = r * (syn->channel[ch].mod_mult * lfo[0] + 1.0);
+  for (i = 0; i < n; i = next) {
+    next = ctl_next(syn, i, n);
+    s1 = r * (syn->channel[ch].mod_mult * lfo[next] + 1.0);
+    ds = (s1 - s0) / (next - i);
+    for (k = i; k < next; k++) {
+      step[k] = s0 + ds * (k - i);
+    }
+    s0 = s1;
+  }
+}
+
+// move the pan of voice slot j one sample closer to its channel pan
+static float voice_pan(struct synth *syn, int j)
+{
+  struct voicepool *pool = &syn->pool;
+  int ch = pool->channel[j];
+
+  /* if active voices are panned, hit target position over one second */
+  if (pool->pan[j] < (float)syn->channel[ch].controller[CTL_PAN] / 127.0) {
+    float delta = (float)syn->channel[ch].controller[CTL_PAN] / 127.0 -
+                  pool->pan[j];
+    pool->pan[j] += delta/syn->rate;  // smooth pan to target in 1s
+  }
+  if (pool->pan[j] > (float)syn->channel[ch].controller[CTL_PAN] / 127.0) {
+    float delta = pool->pan[j] -
+                  (float)syn->channel[ch].controller[CTL_PAN] / 127.0;
+    pool->pan[j] -= delta/syn->rate;  // smooth pan to target in 1s
+  }
+  return pool->pan[j];
+}
+
+// render math synthesis voice slot j into out for up to n samples
+static void render_math(struct synth *syn, int j, float *out, float *lfo,
+                        int n)
+{
+  struct voicepool *pool = &syn->pool;
+  float level[SAMPLELEN];
+  double step[SAMPLELEN];
+  int i, ch = pool->channel[j];
+  int pgm = -syn->channel[ch].program - 2;  // do math based synthesis
+  float t = pool->t[j];  // each voice has its own timebase
+
+  n = voice_levels(syn, j, level, n);
+  voice_steps(syn, j, lfo, step, n);
+  for (i = 0; i < n; i++) {
+    float sample;
+    if (t > 2 * M_PI) {
+      t -= 2 * M_PI;
+    }
+    if (t < 0) {
+      t += 2 * M_PI;
+    }
+    if (pgm <= -1) { // sine
+      sample = sin(t);
+    } else {  // for all othe negative values be a minimoog
+      // morph between tri, saw, square, rect wave full negative pgm value
+      float saw;
+      //float tri, squ, pwm = (lfo[i] + 1.0) * 0.98;
+      //tri = (fabs(0.3184 * (t - M_PI)) - 1.0);
+      saw = 0.3184 * (t - M_PI);
+      //squ = (t > M_PI * pwm ? -1.0 : 1.0);
+      sample = saw; //squ * pwm + saw * (2.0 - pwm);
+    }
+    sample *= pool->v[j] * level[i];
+    voice_pan(syn, j);
+    out[i * 2] += sample * (1.0 - pool->pan[j]);
+    out[i * 2 + 1] += sample * pool->pan[j];
+    t += step[i];
+  }
+  pool->t[j] = t;  // save in per-voice timebase
+}
+
+// cubic interpolate one sample of voice slot j at timebase t, wrapping
+// taps that run past the loop end and clamping those past the sample end
+static float cubic_clamped(struct synth *syn, int j, float t)
+{
+  struct voicepool *pool = &syn->pool;
+  struct sfSFBK *sf2 = syn->sf2;
+  int index = pool->s[j].dwStart + (int)t;
+  // more info: http://paulbourke.net/miscellaneous/interpolation/
+  float mu = t - (int)t, mu2 = mu * mu;
+  float a0, a1, a2, a3;
+  float y0, y1, y2, y3;
+  y0 = (float)sf2->smpl[index++];
+  if ((pool->s[j].sampleModes & 1) && index >= pool->s[j].dwEndloop) {
+    index = pool->s[j].dwStartloop;
+  } else if (index > pool->s[j].dwEnd) {
+    index = pool->s[j].dwEnd;
+  }
+  y1 = (float)sf2->smpl[index++];
+  if ((pool->s[j].sampleModes & 1) && index >= pool->s[j].dwEndloop) {
+    index = pool->s[j].dwStartloop;
+  } else if (index > pool->s[j].dwEnd) {
+    index = pool->s[j].dwEnd;
+  }
+  y2 = (float)sf2->smpl[index++];
+  if ((pool->s[j].sampleModes & 1) && index >= pool->s[j].dwEndloop) {
+    index = pool->s[j].dwStartloop;
+  } else if (index > pool->s[j].dwEnd) {
+    index = pool->s[j].dwEnd;
+  }
+  y3 = (float)sf2->smpl[index];
+  a0 = y3 - y2 - y0 + y1;
+  a1 = y0 - y1 - a0;
+  a2 = y2 - y0;
+  a3 = y1;
+  return a0 * mu * mu2 + a1 * mu2 + a2 * mu + a3;
+}
+
+// interpolate m samples of voice slot j at positions tpos from sf2->smpl
+static void wave_smpl(struct synth *syn, int j, float *tpos, float *y, int m)
+{
+  struct sf2gen *s = &syn->pool.s[j];
+  Uint32 safe = s->dwEnd + 1;  // taps at or past this need clamping
+  int i, run;
+
+  if ((s->sampleModes & 1) && s->dwEndloop < safe) {
+    safe = s->dwEndloop;
+  }
+  for (i = 0; i < m; i += run) {
+    for (run = 0; i + run < m &&
+         s->dwStart + (int)tpos[i + run] + 3 < safe; run++);
+    if (run) {
+      interp_cubic(&syn->sf2->smpl[s->dwStart], &tpos[i], &y[i], run);
+    } else {
+      y[i] = cubic_clamped(syn, j, tpos[i]);
+      run = 1;
+    }
+  }
+  for (i = 0; i < m; i++) {
+    y[i] *= (1.0 / 32767.0);
+  }
+}
+
+// interpolate m samples of voice slot j at positions tpos from its float
+// cache, where guard frames make every read up to the loop seam safe
+static void wave_cache(struct synth *syn, int j, float *tpos, float *y, int m)
+{
+  struct voicepool *pool = &syn->pool;
+  struct sf2gen *s = &pool->s[j];
+  struct sfCache *c = pool->cache[j];
+  float *base = c->data + (s->dwStart - syn->sf2->shdr[pool->shdr[j]].dwStart);
+  Uint32 seam = s->dwEnd;  // first index read from the seam or silence
+  int i, run;
+
+  if (s->sampleModes & 1) {
+    seam = s->dwEndloop - CACHE_GUARD;
+  }
+  for (i = 0; i < m; i += run) {
+    for (run = 0; i + run < m &&
+         s->dwStart + (int)tpos[i + run] < seam; run++);
+    if (run) {
+      interp_cubic_f(base, &tpos[i], &y[i], run);
+    } else if (s->dwStart + (int)tpos[i] >= s->dwEnd) {
+      y[i] = 0.0;  // all four taps in the silence past the end
+      run = 1;
+    } else if ((s->sampleModes & 1) &&
+               s->dwStart + (int)tpos[i] < s->dwEndloop) {
+      float p = tpos[i] - (seam - s->dwStart);
+      interp_cubic_f(c->seam, &p, &y[i], 1);
+      run = 1;
+    } else {
+      y[i] = cubic_clamped(syn, j, tpos[i]) * (1.0 / 32767.0);
+      run = 1;
+    }
+  }
+}
+
+// nonzero if timebase t of a voice playing s needs a loop wrap or end
+static int wave_past(struct sf2gen *s, float t)
+{
+  return ((s->sampleModes & 1) && t + s->dwStart >= s->dwEndloop) ||
+         t + s->dwStart >= s->dwEnd;
+}
+
+// render wavetable voice slot j into out for up to n samples
+// the loop and end checks run once per stretch of samples that can't
+// reach either point, sized from the largest step the timebase can take.
+// read positions are gathered first so the interpolation kernels can work
+// on runs of samples whose taps need no wrapping or clamping
+static void render_wave(struct synth *syn, int j, float *out, float *lfo,
+                        int n)
+{
+  struct voicepool *pool = &syn->pool;
+  float tpos[SAMPLELEN], level[SAMPLELEN], y[SAMPLELEN];
+  double step[SAMPLELEN];
+  int i, m, run, ch = pool->channel[j];
+  struct sf2gen *s = &pool->s[j];
+  float t = pool->t[j];  // each voice has its own timebase
+  // the timebase never moves more than maxstep per sample
+  double maxstep = pool->r[j] * syn->channel[ch].bender_mult *
+                   (fabs(syn->channel[ch].mod_mult) + 1.0) * 1.0001;
+  double bound = s->dwEnd;
+
+  if ((s->sampleModes & 1) && s->dwEndloop < bound) {
+    bound = s->dwEndloop;
+  }
+  n = voice_levels(syn, j, level, n);
+  voice_steps(syn, j, lfo, step, n);
+  for (m = 0; m < n; m += run) {
+    if ((s->sampleModes & 1) && t + s->dwStart >= s->dwEndloop) {
+      t = s->dwStartloop - s->dwStart;
+    }
+    if (t + s->dwStart >= s->dwEnd) {
+      pool->endstamp[j] = 0;  // kill off voice when completely played
+      n = m + 1;
+    }
+    // samples left before the timebase can reach the loop end or the end
+    run = SDL_min(n - m, SDL_max(1.0, (bound - s->dwStart - t) / maxstep));
+    for (i = m; i < m + run; i++) {
+      tpos[i] = t;
+      t += step[i];
+    }
+    // rounding can put the last few samples past the boundary, back up
+    // to the first one that needs the checks above
+    if (run > 1 && wave_past(s, tpos[m + run - 1])) {
+      int lo = m, hi = m + run - 1;  // tpos[lo] is fine, tpos[hi] is not
+      while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if (wave_past(s, tpos[mid])) {
+          hi = mid;
+        } else {
+          lo = mid;
         }
-        y3 = (float)sf2.smpl[index];
-        a0 = y3 - y2 - y0 + y1;
-        a1 = y0 - y1 - a0;
-        a2 = y2 - y0;
-        a3 = y1;
-        sample = a0 * mu * mu2 + a1 * mu2 + a2 * mu + a3;
-        sample *= (1.0 / 32767.0);
       }
-      sample *= voice[j].v * vmod;
-      /* if active voices are panned, hit target position over one second */
-      if (voice[j].pan < (float)channel[ch].controller[CTL_PAN] / 127.0) {
-        float delta = (float)channel[ch].controller[CTL_PAN] / 127.0 -
-                      voice[j].pan;
-        voice[j].pan += delta/rate;  // smooth pan to target in 1s
+      t = tpos[hi];
+      run = hi - m;
+    }
+  }
+  pool->t[j] = t;  // save in per-voice timebase
+  if (pool->cache[j]) {
+    wave_cache(syn, j, tpos, y, n);
+  } else {
+    wave_smpl(syn, j, tpos, y, n);
+  }
+  for (i = 0; i < n; i++) {
+    float sample = y[i];
+    sample *= pool->v[j] * level[i];
+    voice_pan(syn, j);
+    out[i * 2] += sample * (1.0 - pool->pan[j]);
+    out[i * 2 + 1] += sample * pool->pan[j];
+  }
+}
+
+// keep whichever thread renders, callback or worker, off the synth state
+static void synth_lock(struct synth *syn)
+{
+  if (syn->ahead_thread) {
+    SDL_LockMutex(syn->ahead_lock);
+  } else if (syn->backend && syn->backend->lock) {
+    syn->backend->lock(syn);
+  }
+}
+
+static void synth_unlock(struct synth *syn)
+{
+  if (syn->ahead_thread) {
+    SDL_UnlockMutex(syn->ahead_lock);
+  } else if (syn->backend && syn->backend->unlock) {
+    syn->backend->unlock(syn);
+  }
+}
+
+// write the header of a stereo wav file of syn->wav_bits samples at the
+// output rate.  the chunk sizes say as much as fits, wav_close() fills
+// them in if rw can seek, streams are read until they end anyway
+static void wav_header(struct synth *syn, SDL_RWops *rw)
+{
+  int bytes = syn->wav_bits / 8;
+
+  SDL_WriteBE32(rw, 'RIFF');    // RIFF chunk container
+  SDL_WriteLE32(rw, ~0);        // count of 'RIFF' chunk data bytes
+  SDL_WriteBE32(rw, 'WAVE');    // RIFF chunk data type = WAVE
+  SDL_WriteBE32(rw, 'fmt ');    // 'fmt ' chunk
+  SDL_WriteLE32(rw, 16);        // count of 'fmt ' chunk data bytes
+  SDL_WriteLE16(rw, bytes == 4 ? 3 : 1);  // compression: 1 = PCM, 3 = float
+  SDL_WriteLE16(rw, 2);         // number of channels = 2
+  SDL_WriteLE32(rw, (int)syn->rate); // sample rate = rate
+  SDL_WriteLE32(rw, 2 * bytes * (int)syn->rate);  // bytes per second
+  SDL_WriteLE16(rw, 2 * bytes); // number of bytes per sample slice
+  SDL_WriteLE16(rw, syn->wav_bits);  // significant bits per sample
+  SDL_WriteBE32(rw, 'data');    // 'data' chunk
+  SDL_WriteLE32(rw, ~0 - 36);   // count of 'data' chunk data bytes
+}
+
+// start a wav file for wav_write(), see wav_header()
+static SDL_RWops *wav_open(struct synth *syn, char *filename)
+{
+  SDL_RWops *rw = SDL_RWFromFile(filename, "wb");
+
+  if (rw) {
+    wav_header(syn, rw);
+  }
+  return rw;
+}
+
+// append n stereo samples to a wav file from wav_open(), as bits bit
+// integers clipped to full scale, or as they are if bits is 32.  returns
+// nonzero if any of it couldn't be written
+static int wav_write(SDL_RWops *rw, int bits, float *f32s, int n)
+{
+  Uint8 buf[SAMPLELEN * 2 * 3], *p;
+  int i, m, error = 0;
+
+  if (bits == 32) {
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+    for (i = 0; i < n * 2; i++) {
+      float f = SDL_SwapFloatLE(f32s[i]);
+      error |= SDL_RWwrite(rw, &f, sizeof(f), 1) != 1;
+    }
+#else
+    error = SDL_RWwrite(rw, f32s, sizeof(float), n * 2) != n * 2;
+#endif
+    return error;
+  }
+  for (; n > 0; n -= m, f32s += m * 2) {
+    m = SDL_min(n, SAMPLELEN);
+    for (i = 0, p = buf; i < m * 2; i++) {
+      float f = SDL_max(-1.0f, SDL_min(1.0f, f32s[i]));
+      Sint32 s = lrintf(f * (bits == 16 ? 32767.0f : 8388607.0f));
+      *p++ = s;
+      *p++ = s >> 8;
+      if (bits == 24) {
+        *p++ = s >> 16;
+      }
+    }
+    error |= SDL_RWwrite(rw, buf, 1, p - buf) != p - buf;
+  }
+  return error;
+}
+
+// fill in the chunk sizes of a wav file from wav_open() and close it
+static void wav_close(SDL_RWops *rw)
+{
+  Sint64 len = SDL_RWtell(rw);
+
+  if (len >= 44 && SDL_RWseek(rw, 4, RW_SEEK_SET) == 4) {
+    /* past 4 GB the sizes can't be right, leave them saying as much */
+    SDL_WriteLE32(rw, SDL_min(len - 8, 0xffffffff));
+    SDL_RWseek(rw, 40, RW_SEEK_SET);
+    SDL_WriteLE32(rw, SDL_min(len - 44, 0xffffffff - 36));
+  }
+  SDL_RWclose(rw);
+}
+
+// finish the stem files, once nothing renders any more spans
+static void stems_close(struct synth *syn)
+{
+  int ch;
+
+  for (ch = 0; ch < 16; ch++) {
+    if (syn->stem[ch]) {
+      wav_close(syn->stem[ch]);
+      syn->stem[ch] = NULL;
+    }
+  }
+}
+
+// open a stem file per soft synth channel, named stem_prefix01.wav on
+static void stems_open(struct synth *syn)
+{
+  char name[FILENAME_MAX];
+  int ch;
+
+  for (ch = 0; ch < 16; ch++) {
+    if (!SYNPLAYING(syn, ch) || ISMIDI(ch)) {
+      continue;  /* nothing of this channel reaches the soft synth */
+    }
+    snprintf(name, sizeof(name), "%s%02d.wav", stem_prefix, ch + 1);
+    if (!(syn->stem[ch] = wav_open(syn, name))) {
+      perror(name);
+      exit(1);
+    }
+  }
+  syn->stems = 1;
+}
+
+// mix the voices of every lane handled by thread t, all lanes if t < 0
+// voice k of the active list always goes to lane k % MIXLANES, or with
+// stems to the lane of its midi channel, and lane 0 is mixed straight
+// into the output when it needs no stem, so the sum of the lanes comes
+// out the same whichever thread, or how many threads, did the work
+static void mix_lanes(struct synth *syn, int t)
+{
+  struct voicepool *pool = &syn->pool;
+  int lane, k, j, step = t < 0 ? 1 : syn->mixthreads;
+  int nlanes = syn->stems ? 16 : SDL_min(MIXLANES, pool->nactive);
+
+  for (lane = t < 0 ? 0 : t; lane < nlanes; lane += step) {
+    float *out = lane || syn->stems ? syn->mix_buf[lane] : syn->mix_out;
+    if (out != syn->mix_out) {
+      memset(out, 0, syn->mix_n * 2 * sizeof(float));
+    }
+    for (k = syn->stems ? 0 : lane; k < pool->nactive;
+         k += syn->stems ? 1 : MIXLANES) {
+      j = pool->active[k];
+      if (syn->stems && pool->channel[j] != lane) {
+        continue;
+      }
+      if (pool->shdr[j] < 0) {
+        render_math(syn, j, out, syn->mix_lfo, syn->mix_n);
+      } else {
+        render_wave(syn, j, out, syn->mix_lfo, syn->mix_n);
       }
-      if (voice[j].pan > (float)channel[ch].controller[CTL_PAN] / 127.0) {
-        float delta = voice[j].pan -
-                      (float)channel[ch].controller[CTL_PAN] / 127.0;
-        voice[j].pan -= delta/rate;  // smooth pan to target in 1s
+    }
+  }
+}
+
+// mixing thread, renders its lanes of each span handed out by render_span
+static int mix_worker(void *data)
+{
+  struct mixthread *m = data;
+
+  for (;;) {
+    SDL_SemWait(m->go);
+    if (m->syn->quit) {
+      break;
+    }
+    mix_lanes(m->syn, m->t);
+    SDL_SemPost(m->syn->mix_done);
+  }
+  return 0;
+}
+
+// start the mixing threads asked for with mixthreads
+static void mix_init(struct synth *syn)
+{
+  int i;
+
+  if (syn->mixthreads > MIXLANES) {
+    syn->mixthreads = MIXLANES;  /* no lanes left for more threads */
+  }
+  if (syn->mixthreads < 2) {
+    return;
+  }
+  syn->mix_done = SDL_CreateSemaphore(0);
+  for (i = 1; i < syn->mixthreads; i++) {
+    struct mixthread *m = &syn->mix[i];
+    m->syn = syn;
+    m->t = i;
+    m->go = SDL_CreateSemaphore(0);
+    if (!syn->mix_done || !m->go ||
+        !(m->thread = SDL_CreateThread(mix_worker, "mixer", m))) {
+      fprintf(stderr, "mixing threads: %s\n", SDL_GetError());
+      exit(1);
+    }
+  }
+}
+
+// render_span(): mix every playing voice into out for n samples
+// out: interleaved stereo output, n: samples to render (<= SAMPLELEN)
+// no events are due inside the span, so voice state only changes when
+// a voice runs out, letting each voice be rendered in one tight loop
+static void render_span(struct synth *syn, float *out, int n)
+{
+  struct voicepool *pool = &syn->pool;
+  float lfo[SAMPLELEN + 1], l0, l1, dl;  // lfo[n] is the value after span
+  int i, j, k, next;
+
+  if (syn->rlfo == 0) {
+    syn->rlfo = 2.0 * M_PI * 8.176 / syn->rate; // 8.176hz lfo by default
+  }
+  // triangle, evaluated at control rate
+  l0 = fabs(0.3184 * (syn->tlfo - M_PI)) - 1.0;
+  for (i = 0; i < n; i = next) {
+    next = ctl_next(syn, i, n);
+    for (k = i; k < next; k++) {  // keep the phase exact, step by step
+      syn->tlfo += syn->rlfo;
+      if (syn->tlfo > 2 * M_PI) {
+        syn->tlfo -= 2 * M_PI;
       }
-      left += sample * (1.0 - voice[j].pan);
-      right += sample * voice[j].pan ;
-      t += voice[j].r * channel[ch].bender_mult *
-        (channel[ch].mod_mult * lfo + 1.0);
-      voice[j].t = t;  // save in per-voice timebase
     }
-    f32s[i * 2] = left;
-    f32s[i * 2 + 1] = right;
-    samplepos++;
-    if (fabs(left) > max_val) {
-      max_val = fabs(left);
+    l1 = fabs(0.3184 * (syn->tlfo - M_PI)) - 1.0;
+    //l1 = sin(tlfo);
+    dl = (l1 - l0) / (next - i);
+    for (k = i; k < next; k++) {
+      lfo[k] = l0 + dl * (k - i);
+    }
+    l0 = l1;
+  }
+  lfo[n] = l0;
+  for (i = 0; i < n; i++) {
+    out[i * 2] = 0.0;
+    out[i * 2 + 1] = 0.0;
+  }
+  syn->mix_out = out;
+  syn->mix_lfo = lfo;
+  syn->mix_n = n;
+  if (syn->mixthreads > 1 && pool->nactive >= MIX_MINVOICES) {
+    for (i = 1; i < syn->mixthreads; i++) {
+      SDL_SemPost(syn->mix[i].go);
+    }
+    mix_lanes(syn, 0);
+    for (i = 1; i < syn->mixthreads; i++) {
+      SDL_SemWait(syn->mix_done);
+    }
+  } else {
+    mix_lanes(syn, -1);
+  }
+  /* reduce the lanes in a fixed order, whatever thread mixed them */
+  for (k = syn->stems ? 0 : 1;
+       k < MIXLANES && (syn->stems || k < pool->nactive); k++) {
+    for (i = 0; i < n * 2; i++) {
+      out[i] += syn->mix_buf[k][i];
+    }
+    if (syn->stems && syn->stem[k] &&
+        wav_write(syn->stem[k], syn->wav_bits, syn->mix_buf[k], n)) {
+      fprintf(stderr, "%s%02d.wav: write failed\n", stem_prefix, k + 1);
+      wav_close(syn->stem[k]);  /* the rest of the stem is lost */
+      syn->stem[k] = NULL;
+    }
+  }
+  /* return voices that ran out during this span to the idle stack */
+  for (i = k = 0; i < pool->nactive; i++) {
+    j = pool->active[i];
+    if (pool->endstamp[j] > syn->samplepos + n) {
+      pool->active[k++] = j;
+    } else {
+      voice_unlink(syn, j);
+      pool->idle[pool->nidle++] = j;
+    }
+  }
+  pool->nactive = k;
+}
+
+// render_audio(): synthesize len stereo samples into f32s
+// the buffer is split into spans at the timestamps of queued events so
+// events stay sample accurate without polling the queue every sample
+static void render_audio(struct synth *syn, float *f32s, int len)
+{
+  int i, n;
+  int nindex_max = len;  /* index of sample with the maximum value in window */
+
+  for (i = 0; i < len; i += n) {
+    struct midi_packet *head, *tail;
+    head = atomic_load_explicit(&syn->tseqh, memory_order_acquire);
+    tail = atomic_load_explicit(&syn->tseqt, memory_order_relaxed);
+    while (tail != head && tail->timestamp <= syn->samplepos) {
+      /* found midi event starting at this sample position to process */
+      process_pkt(syn, tail);
+      tail = next_pkt(syn, tail);
+      atomic_store_explicit(&syn->tseqt, tail, memory_order_release);
+      atomic_fetch_add_explicit(&syn->pkts_out, 1, memory_order_relaxed);
+    }
+    n = len - i;
+    if (n > SAMPLELEN) {
+      n = SAMPLELEN;
+    }
+    if (tail != head && tail->timestamp - syn->samplepos < n) {
+      n = tail->timestamp - syn->samplepos;  /* stop at the next event */
+    }
+    render_span(syn, &f32s[i * 2], n);
+    syn->samplepos += n;
+  }
+  atomic_store_explicit(&syn->playpos, syn->samplepos, memory_order_relaxed);
+  for (i = 0; i < len; i++) {
+    if (fabs(f32s[i * 2]) > syn->max_val) {
+      syn->max_val = fabs(f32s[i * 2]);
       nindex_max = i;
     }
-    if (fabs(right) > max_val) {
-      max_val = fabs(right);
+    if (fabs(f32s[i * 2 + 1]) > syn->max_val) {
+      syn->max_val = fabs(f32s[i * 2 + 1]);
       nindex_max = i;
     }
   }
@@ -760,94 +1426,204 @@ void fill_audio(void *udata, Uint8 *stream, int len)
    * this is a good tradeoff vs always having output that is too quiet
    * because of the headroom reserved for hundreds of voices going.
    */
-  if (max_val < 1.0) {
-    max_val = 1.0;  /* don't apply any gain to very quiet sections */
+  if (syn->max_val < 1.0) {
+    syn->max_val = 1.0;  /* don't apply any gain to very quiet sections */
   }
-  if (max_val > 0.0) { /* should always be true in normal operation */
-    float normalize_old = normalize;
-    float normalize_diff = (1.0 / max_val) - normalize_old;
+  if (syn->max_val > 0.0) { /* should always be true in normal operation */
+    float normalize_old = syn->normalize;
+    float normalize_diff = (1.0 / syn->max_val) - normalize_old;
     for (i = 0; i < len; i++) {
       if (i < nindex_max) {
-        normalize = normalize_old +
+        syn->normalize = normalize_old +
                 normalize_diff * (float)i / (float)nindex_max;
       } else {
-        normalize = 1.0 / max_val;
+        syn->normalize = 1.0 / syn->max_val;
       }
-      f32s[i * 2] *= normalize;
-      f32s[i * 2 + 1] *= normalize;
+      f32s[i * 2] *= syn->normalize;
+      f32s[i * 2 + 1] *= syn->normalize;
     }
   }
 
 }
 
-void save_audio(char *filename)
+// render ahead worker: keeps the block ring full, one block at a time
+static int ahead_render(void *data)
 {
-  SDL_RWops *rw = SDL_RWFromFile(filename, "w");
-  int len = 0;                  // TODO: calculate number of samples to save
-  Uint8 *buf = malloc(len);     // space for everything at once
-  if (!buf) {
-    perror("malloc");
-    return;
+  struct synth *syn = data;
+
+  for (;;) {
+    unsigned int head = atomic_load_explicit(&syn->ahead_head,
+                                             memory_order_relaxed);
+    SDL_SemWait(syn->ahead_free);  /* wait for the callback to free a block */
+    if (syn->quit) {
+      break;
+    }
+    SDL_LockMutex(syn->ahead_lock);
+    render_audio(syn, &syn->ahead_pcm[(head % syn->renderahead) *
+                                      SAMPLELEN * 2], SAMPLELEN);
+    SDL_UnlockMutex(syn->ahead_lock);
+    atomic_store_explicit(&syn->ahead_head, head + 1, memory_order_release);
   }
-  if (!rw) {
-    perror(filename);
-    return;
+  return 0;
+}
+
+// copy len stereo samples out of the block ring, silence if it ran dry
+static void ahead_copy(struct synth *syn, float *f32s, int len)
+{
+  unsigned int tail = atomic_load_explicit(&syn->ahead_tail,
+                                           memory_order_relaxed);
+
+  while (len > 0) {
+    int n = SAMPLELEN - syn->ahead_off;
+    if (tail == atomic_load_explicit(&syn->ahead_head,
+                                     memory_order_acquire)) {
+      memset(f32s, 0, len * 2 * sizeof(float));  /* worker fell behind */
+      return;
+    }
+    if (n > len) {
+      n = len;
+    }
+    memcpy(f32s, &syn->ahead_pcm[((tail % syn->renderahead) * SAMPLELEN +
+                                  syn->ahead_off) * 2], n * 2 * sizeof(float));
+    f32s += n * 2;
+    len -= n;
+    syn->ahead_off += n;
+    if (syn->ahead_off == SAMPLELEN) {
+      syn->ahead_off = 0;
+      atomic_store_explicit(&syn->ahead_tail, ++tail, memory_order_release);
+      SDL_SemPost(syn->ahead_free);
+    }
   }
+}
 
-  // wave file header, 16 bit stereo
-  SDL_WriteBE32(rw, 'RIFF');    // RIFF chunk container
-  SDL_WriteLE32(rw, len + 44 - 8);  // count of 'RIFF' chunk data bytes
-  SDL_WriteBE32(rw, 'WAVE');    // RIFF chunk data type = WAVE
-  SDL_WriteBE32(rw, 'fmt ');    // 'fmt ' chunk 
-  SDL_WriteLE32(rw, 16);        // count of 'fmt ' chunk data bytes
-  SDL_WriteLE16(rw, 1);         // compression code: 1 = PCM, 3 = float
-  SDL_WriteLE16(rw, 2);         // number of channels = 2
-  SDL_WriteLE32(rw, (int)rate); // sample rate = rate
-  SDL_WriteLE32(rw, 2 * 2 * (int)rate);  // bytes per second
-  SDL_WriteLE16(rw, 2 * 2);     // number of bytes per sample slice
-  SDL_WriteLE16(rw, 16);        // significant bits per sample, float=32 or 64
-  SDL_WriteBE32(rw, 'data');    // 'data' chunk
-  // assume no error on last header write means the previous writes all worked
-  if (SDL_WriteLE32(rw, len) < 1) {  // count of 'data' chunk data bytes
-    perror(filename);
+// render the output into syn->out up to sample position end, in whole
+// blocks of SAMPLELEN the way the audio callback gets it.  the blocks
+// don't depend on where the events fall, so neither does normalization,
+// and memory stays the same however long the song is
+static void render_out(struct synth *syn, Uint64 end)
+{
+  float buf[SAMPLELEN * 2];
+
+  while (syn->samplepos + SAMPLELEN <= end && !syn->out_failed) {
+    render_audio(syn, buf, SAMPLELEN);
+    syn->out_failed = wav_write(syn->out, syn->out_wav ? syn->wav_bits : 32,
+                                buf, SAMPLELEN);
+  }
+}
+
+// render songs on syn to rw as fast as it can, instead of playing them,
+// until synth_close_out().  a wav file if wav is set, or else the bare
+// samples.  call before seq_reset() starts a song
+int synth_open_rw(struct synth *syn, SDL_RWops *rw, int wav)
+{
+  if (syn->backend || !rw) {
+    return -1;
+  }
+  syn->backend = &file_backend;
+  syn->out = rw;
+  syn->out_wav = wav;
+  syn->out_failed = 0;
+  if (wav) {
+    wav_header(syn, rw);
+  }
+  syn->poly_peak = 0;
+  return 0;
+}
+
+// render to a new wav file, see synth_open_rw()
+int synth_open_wav(struct synth *syn, char *filename)
+{
+  if (syn->backend) {
+    return -1;
   }
+  return synth_open_rw(syn, SDL_RWFromFile(filename, "wb"), 1);
+}
 
-  fill_audio(NULL, buf, len);  // render entire sequence to memory
+// let the last notes ring out, for at most TAIL_MAXMS, and close the output
+void synth_close_out(struct synth *syn)
+{
+  Uint64 end = syn->samplepos + (Uint64)(TAIL_MAXMS * syn->rate / 1000.0);
 
-  if (SDL_RWwrite(rw, buf, 1, len) != len) {
-    perror(filename);
+  while ((syn->pool.nactive > 0 || seq_queue_depth(syn, NULL) > 0) &&
+         syn->samplepos < end && !syn->out_failed) {
+    render_out(syn, syn->samplepos + SAMPLELEN);
+  }
+  if (syn->out_wav) {
+    wav_close(syn->out);
   } else {
-    fprintf(stderr, "Wrote %d bytes\n", len);
+    SDL_RWclose(syn->out);
   }
-  SDL_RWclose(rw);
+  syn->out = NULL;
+  syn->backend = NULL;
 }
 
-void open_sdl_dev(void)
+// fill_audio(): callback that will fill supplied buffer with audio data
+// udata: parameter supplied in SDL_AudioSpec userdata field, the synth
+// stream: pointer to the audio data buffer to be filled
+// len: the length of that buffer in bytes
+void fill_audio(void *udata, Uint8 *stream, int len)
 {
-  SDL_AudioSpec want, have;
+  struct synth *syn = udata;
+
+  len >>= 3; // convert from bytes to samples
+  if (syn->ahead_thread) {
+    ahead_copy(syn, (float *)stream, len);  /* worker did the synthesis */
+  } else {
+    render_audio(syn, (float *)stream, len);
+  }
+}
 
-  if (sdl_dev != 0) {
-    return;  /* already opened */
+// set up the render ahead ring and its worker, if renderahead asks for it
+static void ahead_open(struct synth *syn)
+{
+  if (syn->renderahead == 0 || syn->ahead_thread) {
+    return;
+  }
+  syn->ahead_pcm = malloc(syn->renderahead * SAMPLELEN * 2 * sizeof(float));
+  syn->ahead_lock = SDL_CreateMutex();
+  syn->ahead_free = SDL_CreateSemaphore(syn->renderahead);
+  if (!syn->ahead_pcm || !syn->ahead_lock || !syn->ahead_free) {
+    fprintf(stderr, "render ahead setup: %s\n", SDL_GetError());
+    exit(1);
+  }
+  syn->ahead_thread = SDL_CreateThread(ahead_render, "render ahead", syn);
+  if (!syn->ahead_thread) {
+    fprintf(stderr, "SDL_CreateThread: %s\n", SDL_GetError());
+    exit(1);
+  }
+  if (verbose) {
+    fprintf(stderr, "rendering %d blocks (%d ms) ahead\n",
+            syn->renderahead,
+            (int)(syn->renderahead * SAMPLELEN * 1000 / syn->rate));
   }
+}
+
+// sdl backend: the audio device callback pulls the audio
+static int sdl_open(struct synth *syn)
+{
+  SDL_AudioSpec want, have;
+
   SDL_zero(want);
   want.freq = SAMPLERATE;
   want.format = AUDIO_F32SYS;
   want.channels = 2;
   want.samples = SAMPLELEN;
   want.callback = fill_audio;
-  want.userdata = NULL;
+  want.userdata = syn;
 
-  load_sf2(sf2_filename);
-  SDL_Init(SDL_INIT_AUDIO);
-  sdl_dev = SDL_OpenAudioDevice(NULL, 0, &want, &have,
-                                SDL_AUDIO_ALLOW_FORMAT_CHANGE);
-  if (sdl_dev == 0) {
+  if (SDL_Init(SDL_INIT_AUDIO) < 0) {
+    fprintf(stderr, "SDL_Init: %s\n", SDL_GetError());
+    return -1;
+  }
+  syn->sdl_dev = SDL_OpenAudioDevice(NULL, 0, &want, &have,
+                                     SDL_AUDIO_ALLOW_FORMAT_CHANGE);
+  if (syn->sdl_dev == 0) {
     fprintf(stderr, "SDL_OpenAudioDevice: %s\n", SDL_GetError());
-    exit(1);
+    return -1;
   }
   if (want.freq != have.freq) {
     fprintf(stderr, "warning: wanted %d, got %d\n", want.freq, have.freq);
-    rate = have.freq;
+    syn->rate = have.freq;
   }
   if (want.format != have.format) {
     fprintf(stderr, "warning: wanted 0x%x, got 0x%x\n",
@@ -857,47 +1633,286 @@ void open_sdl_dev(void)
     fprintf(stderr, "warning: wanted %dch, got %dch\n",
             want.channels, have.channels);
   }
+  ahead_open(syn);
+  return 0;
+}
+
+static void sdl_start(struct synth *syn)
+{
+  SDL_PauseAudioDevice(syn->sdl_dev, 0);  /* start filling audio buffer */
+}
+
+static void sdl_close(struct synth *syn)
+{
+  SDL_CloseAudioDevice(syn->sdl_dev);  /* no more callbacks after this */
+  syn->sdl_dev = 0;
+}
+
+static void sdl_lock(struct synth *syn)
+{
+  SDL_LockAudioDevice(syn->sdl_dev);
+}
+
+static void sdl_unlock(struct synth *syn)
+{
+  SDL_UnlockAudioDevice(syn->sdl_dev);
+}
+
+// null backend: a thread pulls a block whenever a sound card would and
+// throws it away, for playing with no sound hardware at all
+static int null_pull(void *data)
+{
+  struct synth *syn = data;
+  float buf[SAMPLELEN * 2];
+  double freq = SDL_GetPerformanceFrequency();
+  Uint64 start = SDL_GetPerformanceCounter(), blocks = 0, due, now;
+
+  while (!syn->quit) {
+    SDL_LockMutex(syn->null_lock);
+    fill_audio(syn, (Uint8 *)buf, sizeof(buf));
+    SDL_UnlockMutex(syn->null_lock);
+    /* keep to the schedule from the start, so sleeps don't add up */
+    due = start + (Uint64)(++blocks * SAMPLELEN * freq / syn->rate);
+    if (due > (now = SDL_GetPerformanceCounter())) {
+      SDL_Delay((due - now) * 1000 / freq);
+    }
+  }
+  return 0;
+}
+
+static int null_open(struct synth *syn)
+{
+  if (!(syn->null_lock = SDL_CreateMutex())) {
+    fprintf(stderr, "SDL_CreateMutex: %s\n", SDL_GetError());
+    return -1;
+  }
+  ahead_open(syn);
+  return 0;
+}
+
+static void null_start(struct synth *syn)
+{
+  if (syn->null_thread) {
+    return;  /* already pulling */
+  }
+  syn->null_thread = SDL_CreateThread(null_pull, "null audio", syn);
+  if (!syn->null_thread) {
+    fprintf(stderr, "SDL_CreateThread: %s\n", SDL_GetError());
+    exit(1);
+  }
+}
+
+static void null_close(struct synth *syn)
+{
+  syn->quit = 1;
+  if (syn->null_thread) {
+    SDL_WaitThread(syn->null_thread, NULL);
+    syn->null_thread = NULL;
+  }
+  SDL_DestroyMutex(syn->null_lock);
+  syn->null_lock = NULL;
+}
+
+static void null_lock(struct synth *syn)
+{
+  SDL_LockMutex(syn->null_lock);
+}
+
+static void null_unlock(struct synth *syn)
+{
+  SDL_UnlockMutex(syn->null_lock);
+}
+
+// null-fast backend: render as fast as the cpu goes in seq_wait(), like
+// a wav file, and throw it away, to see how fast the engine really is
+static int fast_open(struct synth *syn)
+{
+  return synth_open_rw(syn, SDL_RWFromFile("/dev/null", "wb"), 0);
+}
+
+// the outputs audio_out can name
+static const struct audio_backend backends[] = {
+  { "sdl", sdl_open, sdl_start, sdl_close, sdl_lock, sdl_unlock },
+  { "null", null_open, null_start, null_close, null_lock, null_unlock },
+  { "null-fast", fast_open },
+  { NULL }
+};
+
+// open the soft synth output named by audio_out.  with no sound device
+// to be had, play to the null output rather than give up
+static void audio_open(struct synth *syn)
+{
+  const struct audio_backend *b;
+
+  for (b = backends; b->name && strcmp(b->name, audio_out); b++);
+  if (!b->name) {
+    fprintf(stderr, "%s: no such audio output, try sdl, null or "
+            "null-fast\n", audio_out);
+    exit(1);
+  }
+  if (b->open(syn) < 0) {
+    if (b != &backends[0]) {
+      exit(1);
+    }
+    fprintf(stderr, "no audio device, playing to the null output\n");
+    if ((b = &backends[1])->open(syn) < 0) {
+      exit(1);
+    }
+  }
+  syn->backend = b;
+  if (verbose) {
+    fprintf(stderr, "audio output: %s\n", b->name);
+  }
+}
+
+// pick the interpolation kernels, once, before any synth can use them
+static void interp_once(void)
+{
+  static SDL_SpinLock lock;
+  static char *kernel;
+
+  SDL_AtomicLock(&lock);
+  if (!kernel) {
+    kernel = interp_init();
+    if (verbose) {
+      fprintf(stderr, "wavetable interpolation: %s\n", kernel);
+    }
+  }
+  SDL_AtomicUnlock(&lock);
+}
+
+// synth_restart(): reset everything a song changes in syn and copy the
+// song options in effect now, so the next song renders just as it would
+// on a new synth.  only while syn renders to a file or not at all
+void synth_restart(struct synth *syn)
+{
+  int ch, note;
+
+  syn->rate = SAMPLERATE;
+  syn->perc = perc;
+  syn->chanmask = chanmask;
+  memcpy(syn->useprog, useprog, sizeof(syn->useprog));
+  memcpy(syn->usevol, usevol, sizeof(syn->usevol));
+  syn->skew = skew;
+  syn->wav_bits = wavbits;
+  syn->ticks = 0;
+  atomic_store(&syn->tseqh, (void *)syn->pdata);
+  atomic_store(&syn->tseqt, (void *)syn->pdata);
+  atomic_store(&syn->pkts_in, 0);
+  atomic_store(&syn->pkts_out, 0);
+  syn->pkts_peak = 0;
+  voice_init(syn);
+  syn->poly_peak = 0;
+  memset(syn->channel, 0, sizeof(syn->channel));
+  memset(syn->seqchan, 0, sizeof(syn->seqchan));
+  syn->atune = 440.0;
+  for (ch = 0; ch < 16; ch++) {
+    for (note = 0; note < 12; note++) {
+      syn->scaletune[ch][note] = 1.0;
+    }
+  }
+  syn->tlfo = syn->rlfo = 0;
+  syn->max_val = 0;
+  syn->normalize = 1.0;
+  syn->samplepos = syn->songpos = 0;
+  atomic_store(&syn->playpos, 0);
 }
 
-void start_sdl_dev(void)
+// synth_new(): create a synth engine instance playing soundfont sf2file,
+// or math synthesis only if it is NULL or can't be loaded.  the options
+// in effect now are copied, seq_reset(syn, 0) then starts a song on it
+struct synth *synth_new(char *sf2file)
 {
-  SDL_PauseAudioDevice(sdl_dev, 0);  /* start filling audio buffer */
+  struct synth *syn = calloc(1, sizeof(struct synth));
+
+  if (!syn) {
+    perror("calloc");
+    return NULL;
+  }
+  syn->ctlrate = ctlrate;
+  syn->mixthreads = mixthreads;
+  syn->renderahead = renderahead;
+  atomic_init(&syn->tseqh, (void *)syn->pdata);
+  atomic_init(&syn->tseqt, (void *)syn->pdata);
+  synth_restart(syn);
+  mix_init(syn);
+  if (stem_prefix) {
+    stems_open(syn);
+  }
+  if (sf2file && (syn->sf2 = load_sf2(sf2file))) {
+    interp_once();
+  }
+  return syn;
 }
 
-void stop_sdl_dev(void)
+// synth_free(): close the output of syn, stop its threads and free it all
+void synth_free(struct synth *syn)
 {
-  SDL_PauseAudioDevice(sdl_dev, 1);  /* stop filling audio buffer */
+  int i;
+
+  if (!syn) {
+    return;
+  }
+  if (syn->backend && syn->backend->close) {
+    syn->backend->close(syn);  /* nothing pulls audio after this */
+  }
+  syn->quit = 1;
+  if (syn->ahead_thread) {
+    SDL_SemPost(syn->ahead_free);
+    SDL_WaitThread(syn->ahead_thread, NULL);
+  }
+  for (i = 1; i < syn->mixthreads; i++) {
+    SDL_SemPost(syn->mix[i].go);
+    SDL_WaitThread(syn->mix[i].thread, NULL);
+    SDL_DestroySemaphore(syn->mix[i].go);
+  }
+  stems_close(syn);
+  if (syn->out) {
+    SDL_RWclose(syn->out);  /* never finished with synth_close_out() */
+  }
+  if (syn->mix_done) {
+    SDL_DestroySemaphore(syn->mix_done);
+  }
+  if (syn->ahead_lock) {
+    SDL_DestroyMutex(syn->ahead_lock);
+  }
+  if (syn->ahead_free) {
+    SDL_DestroySemaphore(syn->ahead_free);
+  }
+  free(syn->ahead_pcm);
+  release_sf2(syn->sf2);
+  free(syn);
 }
 
 
 struct sysex_stuff {
   int bytes; // minimum bytes needed to dispatch handler
-  void (*handler)(Uint8 *);  // soft handler
+  void (*handler)(struct synth *, Uint8 *);  // soft handler
   Uint32 match; // big endian data to match
   Uint32 mask;  // big endian mask to apply before match
 };
 
-static void sys_gm1_on(Uint8 *data) { seq_reset(1); }
-static void sys_gm2_on(Uint8 *data) { seq_reset(1); }
-static void sys_master_v(Uint8 *data) { /* no-op for now */ }
+static void sys_gm1_on(struct synth *syn, Uint8 *data) { seq_reset(syn, 1); }
+static void sys_gm2_on(struct synth *syn, Uint8 *data) { seq_reset(syn, 1); }
+static void sys_master_v(struct synth *syn, Uint8 *data) { /* no-op */ }
 
-static void sys_master_ft(Uint8 *data)
+static void sys_master_ft(struct synth *syn, Uint8 *data)
 {
   int bend = data[1];
   bend <<= 7;
   bend |= data[0];
-  atune = 440 * pitchbend_to_freqmult(bend, 1);
+  syn->atune = 440 * pitchbend_to_freqmult(bend, 1);
 }
 
-static void sys_master_ct(Uint8 *data)
+static void sys_master_ct(struct synth *syn, Uint8 *data)
 {
   int cents = data[1];
   cents -= 64;
   cents *= 100;
-  atune = 440 * cents_to_freqmult(cents, 1, 1);
+  syn->atune = 440 * cents_to_freqmult(cents, 1, 1);
 }
 
-static void sys_scale_tune(Uint8 *data)
+static void sys_scale_tune(struct synth *syn, Uint8 *data)
 {
   int note, ch, chmask;
   chmask = *data++;
@@ -913,13 +1928,13 @@ static void sys_scale_tune(Uint8 *data)
     f = cents_to_freqmult(cents, 1, 1);
     for (ch = 0; ch < 16; ch++) {
       if (chmask & (1<<ch)) {
-        scaletune[ch][note] = f;
+        syn->scaletune[ch][note] = f;
       }
     }
   }
 }
 
-static void sys_scale_tune2(Uint8 *data)
+static void sys_scale_tune2(struct synth *syn, Uint8 *data)
 {
   int note, ch, chmask;
   chmask = *data++;
@@ -936,7 +1951,7 @@ static void sys_scale_tune2(Uint8 *data)
     f = pitchbend_to_freqmult(bend, 1);
     for (ch = 0; ch < 16; ch++) {
       if (chmask & (1<<ch)) {
-        scaletune[ch][note] = f;
+        syn->scaletune[ch][note] = f;
       }
     }
   }
@@ -945,44 +1960,50 @@ static void sys_scale_tune2(Uint8 *data)
 /* fixme?: this is buggy if done 2x before new notes start */
 /* but this is faster than recalculating all sf2 mods */
 /* it's still rare to find any midi file with this message */
-static void realtime_tune(void)
+/* runs on the parsing side, so the renderer is kept off the active list */
+static void realtime_tune(struct synth *syn)
 {
-  int j;
-  for (j = 0; j < POLYMAX; j++) {
-    int note = voice[j].note;
-    int ch = voice[j].channel;
-    voice[j].r *= scaletune[ch][note % 12];
+  struct voicepool *pool = &syn->pool;
+  int i;
+  synth_lock(syn);
+  for (i = 0; i < pool->nactive; i++) {
+    int j = pool->active[i];
+    int note = pool->note[j];
+    int ch = pool->channel[j];
+    pool->r[j] *= syn->scaletune[ch][note % 12];
   }
+  synth_unlock(syn);
 }
 
-static void sys_scale_tuner(Uint8 *data)
+static void sys_scale_tuner(struct synth *syn, Uint8 *data)
 {
-  sys_scale_tune(data);
-  realtime_tune();
+  sys_scale_tune(syn, data);
+  realtime_tune(syn);
 }
 
-static void sys_scale_tune2r(Uint8 *data)
+static void sys_scale_tune2r(struct synth *syn, Uint8 *data)
 {
-  sys_scale_tune2(data);
-  realtime_tune();
+  sys_scale_tune2(syn, data);
+  realtime_tune(syn);
 }
 
 /* parse roland gs patch part parameters (M-GS64/VE-GS Pro) */
-static void sys_gs_dt1(Uint8 *data)
+static void sys_gs_dt1(struct synth *syn, Uint8 *data)
 {
   if (data[0] == 0x40 && (data[1] & 0xf0) == 0x10 && data[2] == 0x15) {
     /* USE RHYTHM PART */
     int part = data[1] & 0xf;
     int mode = data[3] & 0x3;
     if (mode) {
-      perc |= (1 << part);
+      syn->perc |= (1 << part);
     } else {
-      perc &= ~(1 << part);
+      syn->perc &= ~(1 << part);
     }
+    chan_preset(syn, part);
   }
   if (!(data[0] & ~0x40) && data[1] == 0x00 && data[2] == 0x7f) {
     /* GS RESET or SYSTEM MODE SET */
-    seq_reset(1);
+    seq_reset(syn, 1);
   }
   if (data[0] == 0x40 && (data[1] & 0xf0) == 0x10 &&
       data[2] >= 0x40 && data[2] <= 0x4b) {
@@ -996,7 +2017,7 @@ static void sys_gs_dt1(Uint8 *data)
     while (data[2] != 0xf7 && note < 12) {
       cents = *data++;
       cents -= 64;
-      scaletune[ch][note++] = cents_to_freqmult(cents, 1, 1);
+      syn->scaletune[ch][note++] = cents_to_freqmult(cents, 1, 1);
     }
   }
 }
@@ -1016,7 +2037,7 @@ struct sysex_stuff sysex[] = {
  { 0, NULL, 0, 0 },  // terminal record
 };
 
-void load_sysex(int length, Uint8 *data, int type)
+void load_sysex(struct synth *syn, int length, Uint8 *data, int type)
 {
   int i;
 
@@ -1028,7 +2049,7 @@ void load_sysex(int length, Uint8 *data, int type)
       continue;
     }
     if ((*(Uint32 *)data & mask) == match) {
-      sysex[i].handler(data + 4);
+      sysex[i].handler(syn, data + 4);
     }
   }
   if (!play_ext)
@@ -1052,123 +2073,159 @@ static int mt32pgm[128] =
  116, 118, 126, 121, 121,  55, 124, 120, 125, 126, 127
 };
 
-void seq_set_patch(int chn, int pgm)
+void seq_set_patch(struct synth *syn, int chn, int pgm)
 {
+  struct midi_packet *p = seq_pkt(syn);
+
   if (MT32 && pgm < 128)
     pgm = mt32pgm[pgm];
-  if (useprog[chn])
-    pgm = useprog[chn] - 1;
+  if (syn->useprog[chn])
+    pgm = syn->useprog[chn] - 1;
   if (ISMIDI(chn)) {
     /* need program data tracked for external synth too */
-    channel[chn].program = pgm;
+    syn->channel[chn].program = pgm;
   }
-  tseqh->len = 2;
-  tseqh->data[0] = MIDI_PGM_CHANGE | chn;
-  tseqh->data[1] = pgm;
-  tseqh = add_pkt(tseqh);
+  syn->seqchan[chn].program = pgm;
+  chan_preset(syn, chn);
+  p->len = 2;
+  p->data[0] = MIDI_PGM_CHANGE | chn;
+  p->data[1] = pgm;
+  add_pkt(syn, p);
 }
 
-void seq_stop_note(int chn, int note, int vel)
+void seq_stop_note(struct synth *syn, int chn, int note, int vel)
 {
-  tseqh->len = 3;
-  tseqh->data[0] = MIDI_NOTEOFF | chn;
-  tseqh->data[1] = note;
-  tseqh->data[2] = vel;
-  tseqh = add_pkt(tseqh);
+  struct midi_packet *p = seq_pkt(syn);
+
+  p->len = 3;
+  p->data[0] = MIDI_NOTEOFF | chn;
+  p->data[1] = note;
+  p->data[2] = vel;
+  add_pkt(syn, p);
 }
 
-void seq_key_pressure(int chn, int note, int vel)
+void seq_key_pressure(struct synth *syn, int chn, int note, int vel)
 {
-  tseqh->len = 3;
-  tseqh->data[0] = MIDI_KEY_PRESSURE | chn;
-  tseqh->data[1] = note;
-  tseqh->data[2] = vel;
-  tseqh = add_pkt(tseqh);
+  struct midi_packet *p = seq_pkt(syn);
+
+  p->len = 3;
+  p->data[0] = MIDI_KEY_PRESSURE | chn;
+  p->data[1] = note;
+  p->data[2] = vel;
+  add_pkt(syn, p);
 }
 
-void seq_start_note(int chn, int note, int vel)
+void seq_start_note(struct synth *syn, int chn, int note, int vel)
 {
+  struct midi_packet *p = seq_pkt(syn);
+
   if (vel == 0 && !ISMIDI(chn)) {
-    seq_stop_note(chn, note, 127);
+    seq_stop_note(syn, chn, note, 127);
     return;
   }
-  tseqh->len = 3;
-  tseqh->data[0] = MIDI_NOTEON | chn;
-  tseqh->data[1] = note;
-  tseqh->data[2] = vel;
-  tseqh = add_pkt(tseqh);
+  p->len = 3;
+  p->data[0] = MIDI_NOTEON | chn;
+  p->data[1] = note;
+  p->data[2] = vel;
+  if (!ISMIDI(chn)) {
+    struct voicestate vs;
+    voice_setup(syn, &vs, chn, note, vel);
+    memcpy(PKT_VOICE(p), &vs, sizeof(vs));
+    p->len += sizeof(vs);
+  }
+  add_pkt(syn, p);
 }
 
-void seq_control(int chn, int p1, int p2)
+void seq_control(struct synth *syn, int chn, int p1, int p2)
 {
+  struct midi_packet *p = seq_pkt(syn);
+
   if (ISMIDI(chn)) {
     /* need controller data tracked for external synth too */
-    channel[chn].controller[p1] = p2;
+    syn->channel[chn].controller[p1] = p2;
   }
-  tseqh->len = 3;
-  tseqh->data[0] = MIDI_CTL_CHANGE | chn;
-  tseqh->data[1] = p1;
-  tseqh->data[2] = p2;
-  tseqh = add_pkt(tseqh);
+  syn->seqchan[chn].controller[p1] = p2;
+  if (p1 == CTL_BANK_SELECT || p1 == CTL_BANK_SELECT + CTL_LSB) {
+    chan_preset(syn, chn);
+  }
+  p->len = 3;
+  p->data[0] = MIDI_CTL_CHANGE | chn;
+  p->data[1] = p1;
+  p->data[2] = p2;
+  add_pkt(syn, p);
 }
 
-void seq_chn_pressure(int chn, int vel)
+void seq_chn_pressure(struct synth *syn, int chn, int vel)
 {
-  tseqh->len = 2;
-  tseqh->data[0] = MIDI_CHN_PRESSURE | chn;
-  tseqh->data[1] = vel;
-  tseqh = add_pkt(tseqh);
+  struct midi_packet *p = seq_pkt(syn);
+
+  p->len = 2;
+  p->data[0] = MIDI_CHN_PRESSURE | chn;
+  p->data[1] = vel;
+  add_pkt(syn, p);
 }
 
-void seq_bender(int chn, int p1, int p2)
+void seq_bender(struct synth *syn, int chn, int p1, int p2)
 {
-  tseqh->len = 3;
-  tseqh->data[0] = MIDI_PITCH_BEND | chn;
-  tseqh->data[1] = p1;
-  tseqh->data[2] = p2;
-  tseqh = add_pkt(tseqh);
+  struct midi_packet *p = seq_pkt(syn);
+
+  p->len = 3;
+  p->data[0] = MIDI_PITCH_BEND | chn;
+  p->data[1] = p1;
+  p->data[2] = p2;
+  add_pkt(syn, p);
 }
 
-void seq_reset(int keep_queue)
+void seq_reset(struct synth *syn, int keep_queue)
 {
   int i;
+  synth_lock(syn);  /* keep the renderer off the queue and the voices */
   if (!keep_queue) {
-    tseqh = tseqt = tseq;
+    atomic_store_explicit(&syn->tseqh, (void *)syn->pdata,
+                          memory_order_relaxed);
+    atomic_store_explicit(&syn->tseqt, (void *)syn->pdata,
+                          memory_order_relaxed);
+    atomic_store_explicit(&syn->pkts_out, atomic_load(&syn->pkts_in),
+                          memory_order_relaxed);
+    syn->songpos = syn->samplepos;  /* song starts at the current output */
+    syn->songtick = SDL_GetTicks();
+    syn->ticks = 0;
   }
   /* kill all playing voices */
   for (i = 0; i < POLYMAX; i++) {
-    voice[i].endstamp = 0;
+    syn->pool.endstamp[i] = 0;
   }
+  synth_unlock(syn);
   /* to keep midi in sync with soft synth, initialize both here */
-  if (play_ext != chanmask) {
+  if (!syn->backend && play_ext != chanmask) {
     /* if everything is not going to external midi */
-    open_sdl_dev();  /* set up sdl audio device for soft playback */
+    audio_open(syn);  /* set up the output for soft playback */
   }
-  if (play_ext & chanmask) {
+  if ((play_ext & chanmask) && !syn->out) {
     init_midi();
   }
-  if (sdl_dev != 0) {
-    /* if sdl_dev opend, start sdl audio to be in sync with external midi */
-    start_sdl_dev();
+  if (syn->backend && syn->backend->start) {
+    /* start the soft synth output to be in sync with external midi */
+    syn->backend->start(syn);
   }
-  atune = 440.0; /* reset any master tune overrides in effect */
+  syn->atune = 440.0; /* reset any master tune overrides in effect */
   for (i = 0; i < 16; i++) {	/* set state info */
     int j;
     /* reset scale tuning to default */
     for (j = 0; j < 12; j++) {
-      scaletune[i][j] = 1.0;
+      syn->scaletune[i][j] = 1.0;
     }
-    channel[i].bender_mult = 1.0;
-    channel[i].bender = 8192;
-    channel[i].bender_range = 2;
-    seq_control(i, CTL_PAN, 64);
-    seq_control(i, CTL_SUSTAIN, 0);
-    seq_control(i, CTL_EXPRESSION, 127);
-    seq_control(i, CTL_ALL_NOTES_OFF, 0);
-    seq_control(i, CTL_ALL_SOUNDS_OFF, 0);
-    seq_control(i, CTL_RESET_ALL_CONTROLLERS,0);
-    seq_control(i, CTL_BANK_SELECT, 0);
-    seq_control(i, CTL_BANK_SELECT + CTL_LSB, 0);
-    seq_set_patch(i, 0);
+    syn->channel[i].bender_mult = 1.0;
+    syn->channel[i].bender = 8192;
+    syn->channel[i].bender_range = 2;
+    seq_control(syn, i, CTL_PAN, 64);
+    seq_control(syn, i, CTL_SUSTAIN, 0);
+    seq_control(syn, i, CTL_EXPRESSION, 127);
+    seq_control(syn, i, CTL_ALL_NOTES_OFF, 0);
+    seq_control(syn, i, CTL_ALL_SOUNDS_OFF, 0);
+    seq_control(syn, i, CTL_RESET_ALL_CONTROLLERS,0);
+    seq_control(syn, i, CTL_BANK_SELECT, 0);
+    seq_control(syn, i, CTL_BANK_SELECT + CTL_LSB, 0);
+    seq_set_patch(syn, i, 0);
   }
 }
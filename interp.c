@@ -0,0 +1,234 @@
+/* interp.c  -  cubic interpolation kernels for wavetable voices
+ *
+ * Each kernel interpolates n output samples of one voice from 16 bit
+ * sample data, or from the normalized float sample cache (the _f
+ * kernels).  pos[] holds the fractional read position of every output
+ * sample relative to smpl, and the caller guarantees that all four taps
+ * (index 0 to index + 3) are inside the sample data, so no kernel needs
+ * to wrap or clamp.  The vector kernels use the same operation order as
+ * the scalar reference, so every kernel produces bit-identical output.
+ *
+ * This file may be freely distributed under the terms of
+ * the GNU General Public Licence (GPL).
+ */
+
+#include "SDL2/SDL.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+// scalar reference kernel
+// more info: http://paulbourke.net/miscellaneous/interpolation/
+static void interp_scalar(const short *smpl, const float *pos, float *out,
+                          int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++) {
+    int index = (int)pos[i];
+    float mu = pos[i] - index, mu2 = mu * mu;
+    float a0, a1, a2, a3;
+    float y0, y1, y2, y3;
+    y0 = (float)smpl[index];
+    y1 = (float)smpl[index + 1];
+    y2 = (float)smpl[index + 2];
+    y3 = (float)smpl[index + 3];
+    a0 = y3 - y2 - y0 + y1;
+    a1 = y0 - y1 - a0;
+    a2 = y2 - y0;
+    a3 = y1;
+    out[i] = a0 * mu * mu2 + a1 * mu2 + a2 * mu + a3;
+  }
+}
+
+// scalar reference kernel for float sample data
+static void interp_scalar_f(const float *smpl, const float *pos, float *out,
+                            int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++) {
+    int index = (int)pos[i];
+    float mu = pos[i] - index, mu2 = mu * mu;
+    float a0, a1, a2, a3;
+    float y0, y1, y2, y3;
+    y0 = smpl[index];
+    y1 = smpl[index + 1];
+    y2 = smpl[index + 2];
+    y3 = smpl[index + 3];
+    a0 = y3 - y2 - y0 + y1;
+    a1 = y0 - y1 - a0;
+    a2 = y2 - y0;
+    a3 = y1;
+    out[i] = a0 * mu * mu2 + a1 * mu2 + a2 * mu + a3;
+  }
+}
+
+#ifdef HAVE_X86_KERNELS
+// four outputs at a time, each lane loads its four taps with one 64 bit read
+__attribute__((target("sse2")))
+static void interp_sse2(const short *smpl, const float *pos, float *out,
+                        int n)
+{
+  int i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    __m128 t = _mm_loadu_ps(pos + i);
+    __m128i ti = _mm_cvttps_epi32(t);
+    __m128 mu = _mm_sub_ps(t, _mm_cvtepi32_ps(ti));
+    __m128 mu2 = _mm_mul_ps(mu, mu);
+    __m128 y0, y1, y2, y3, a0, a1, a2, r;
+    __m128i l0, l1, l2, l3, y01, y23;
+    int idx[4];
+
+    _mm_storeu_si128((__m128i *)idx, ti);
+    l0 = _mm_loadl_epi64((const __m128i *)&smpl[idx[0]]);
+    l1 = _mm_loadl_epi64((const __m128i *)&smpl[idx[1]]);
+    l2 = _mm_loadl_epi64((const __m128i *)&smpl[idx[2]]);
+    l3 = _mm_loadl_epi64((const __m128i *)&smpl[idx[3]]);
+    // transpose four lanes of four taps into one vector per tap
+    l0 = _mm_unpacklo_epi16(l0, l1);
+    l2 = _mm_unpacklo_epi16(l2, l3);
+    y01 = _mm_unpacklo_epi32(l0, l2);
+    y23 = _mm_unpackhi_epi32(l0, l2);
+    // sign extend 16 bit taps to 32 bit and convert
+    y0 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(y01, y01), 16));
+    y1 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(y01, y01), 16));
+    y2 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(y23, y23), 16));
+    y3 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(y23, y23), 16));
+    a0 = _mm_add_ps(_mm_sub_ps(_mm_sub_ps(y3, y2), y0), y1);
+    a1 = _mm_sub_ps(_mm_sub_ps(y0, y1), a0);
+    a2 = _mm_sub_ps(y2, y0);
+    r = _mm_mul_ps(_mm_mul_ps(a0, mu), mu2);
+    r = _mm_add_ps(r, _mm_mul_ps(a1, mu2));
+    r = _mm_add_ps(r, _mm_mul_ps(a2, mu));
+    r = _mm_add_ps(r, y1);
+    _mm_storeu_ps(out + i, r);
+  }
+  interp_scalar(smpl, pos + i, out + i, n - i);
+}
+
+// eight outputs at a time, a 32 bit gather at 16 bit scale fetches two taps
+__attribute__((target("avx2")))
+static void interp_avx2(const short *smpl, const float *pos, float *out,
+                        int n)
+{
+  int i;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m256 t = _mm256_loadu_ps(pos + i);
+    __m256i ti = _mm256_cvttps_epi32(t);
+    __m256 mu = _mm256_sub_ps(t, _mm256_cvtepi32_ps(ti));
+    __m256 mu2 = _mm256_mul_ps(mu, mu);
+    __m256i g01 = _mm256_i32gather_epi32((const int *)smpl, ti, 2);
+    __m256i g23 = _mm256_i32gather_epi32((const int *)smpl,
+                      _mm256_add_epi32(ti, _mm256_set1_epi32(2)), 2);
+    __m256 y0, y1, y2, y3, a0, a1, a2, r;
+
+    y0 = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(g01, 16), 16));
+    y1 = _mm256_cvtepi32_ps(_mm256_srai_epi32(g01, 16));
+    y2 = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(g23, 16), 16));
+    y3 = _mm256_cvtepi32_ps(_mm256_srai_epi32(g23, 16));
+    a0 = _mm256_add_ps(_mm256_sub_ps(_mm256_sub_ps(y3, y2), y0), y1);
+    a1 = _mm256_sub_ps(_mm256_sub_ps(y0, y1), a0);
+    a2 = _mm256_sub_ps(y2, y0);
+    r = _mm256_mul_ps(_mm256_mul_ps(a0, mu), mu2);
+    r = _mm256_add_ps(r, _mm256_mul_ps(a1, mu2));
+    r = _mm256_add_ps(r, _mm256_mul_ps(a2, mu));
+    r = _mm256_add_ps(r, y1);
+    _mm256_storeu_ps(out + i, r);
+  }
+  interp_sse2(smpl, pos + i, out + i, n - i);
+}
+
+// four outputs at a time, each lane loads its four taps as one vector
+__attribute__((target("sse2")))
+static void interp_sse2_f(const float *smpl, const float *pos, float *out,
+                          int n)
+{
+  int i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    __m128 t = _mm_loadu_ps(pos + i);
+    __m128i ti = _mm_cvttps_epi32(t);
+    __m128 mu = _mm_sub_ps(t, _mm_cvtepi32_ps(ti));
+    __m128 mu2 = _mm_mul_ps(mu, mu);
+    __m128 y0, y1, y2, y3, a0, a1, a2, r;
+    int idx[4];
+
+    _mm_storeu_si128((__m128i *)idx, ti);
+    y0 = _mm_loadu_ps(&smpl[idx[0]]);
+    y1 = _mm_loadu_ps(&smpl[idx[1]]);
+    y2 = _mm_loadu_ps(&smpl[idx[2]]);
+    y3 = _mm_loadu_ps(&smpl[idx[3]]);
+    _MM_TRANSPOSE4_PS(y0, y1, y2, y3);
+    a0 = _mm_add_ps(_mm_sub_ps(_mm_sub_ps(y3, y2), y0), y1);
+    a1 = _mm_sub_ps(_mm_sub_ps(y0, y1), a0);
+    a2 = _mm_sub_ps(y2, y0);
+    r = _mm_mul_ps(_mm_mul_ps(a0, mu), mu2);
+    r = _mm_add_ps(r, _mm_mul_ps(a1, mu2));
+    r = _mm_add_ps(r, _mm_mul_ps(a2, mu));
+    r = _mm_add_ps(r, y1);
+    _mm_storeu_ps(out + i, r);
+  }
+  interp_scalar_f(smpl, pos + i, out + i, n - i);
+}
+
+// eight outputs at a time, one gather per tap
+__attribute__((target("avx2")))
+static void interp_avx2_f(const float *smpl, const float *pos, float *out,
+                          int n)
+{
+  int i;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m256 t = _mm256_loadu_ps(pos + i);
+    __m256i ti = _mm256_cvttps_epi32(t);
+    __m256 mu = _mm256_sub_ps(t, _mm256_cvtepi32_ps(ti));
+    __m256 mu2 = _mm256_mul_ps(mu, mu);
+    __m256 y0, y1, y2, y3, a0, a1, a2, r;
+
+    y0 = _mm256_i32gather_ps(smpl, ti, 4);
+    y1 = _mm256_i32gather_ps(smpl + 1, ti, 4);
+    y2 = _mm256_i32gather_ps(smpl + 2, ti, 4);
+    y3 = _mm256_i32gather_ps(smpl + 3, ti, 4);
+    a0 = _mm256_add_ps(_mm256_sub_ps(_mm256_sub_ps(y3, y2), y0), y1);
+    a1 = _mm256_sub_ps(_mm256_sub_ps(y0, y1), a0);
+    a2 = _mm256_sub_ps(y2, y0);
+    r = _mm256_mul_ps(_mm256_mul_ps(a0, mu), mu2);
+    r = _mm256_add_ps(r, _mm256_mul_ps(a1, mu2));
+    r = _mm256_add_ps(r, _mm256_mul_ps(a2, mu));
+    r = _mm256_add_ps(r, y1);
+    _mm256_storeu_ps(out + i, r);
+  }
+  interp_sse2_f(smpl, pos + i, out + i, n - i);
+}
+#endif
+
+// kernels used by the synth, see interp_init()
+void (*interp_cubic)(const short *, const float *, float *, int) =
+  interp_scalar;
+void (*interp_cubic_f)(const float *, const float *, float *, int) =
+  interp_scalar_f;
+
+// pick the fastest kernel this cpu supports, returns its name
+char *interp_init(void)
+{
+#ifdef HAVE_X86_KERNELS
+  if (SDL_HasAVX2()) {
+    interp_cubic = interp_avx2;
+    interp_cubic_f = interp_avx2_f;
+    return "avx2";
+  }
+  if (SDL_HasSSE2()) {
+    interp_cubic = interp_sse2;
+    interp_cubic_f = interp_sse2_f;
+    return "sse2";
+  }
+#endif
+  interp_cubic = interp_scalar;
+  interp_cubic_f = interp_scalar_f;
+  return "scalar";
+}
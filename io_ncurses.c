@@ -64,14 +64,15 @@ char *minsharp[15] =		/* name of minor key with 'x' sharps */
  "C##", "G##", "D##", "A##"};	/* only first 8 defined by file format */
 
 extern int graphics, verbose, perc;
-extern int format, ntrks, division;
+extern struct midisong song;
 extern Uint32 ticks;
 extern char *filename;
-extern float skew;
-extern void seq_reset(int);
+extern void seq_reset(struct synth *, int);
+extern int seq_queue_depth(struct synth *, int *);
+extern struct synth *synth;
 extern struct timeval start_time;
 
-struct timeval now_time, want_time;
+struct timeval now_time;
 char textbuf[1024], **nn;
 int i, ytxt, karaoke;
 
@@ -95,18 +96,16 @@ int error;
 #define YPOS		(CHN(cmd) + 2)
 #define NNAME		nn[NOTE % 12]
 
-extern struct chanstate channel[16];  // presently active channel state
-
 static char *gsfind(int pgm, int ch, int key)
 {
   int i, bank;
   char *rv = NULL;
-  struct gsvoices *gs = key ? gs_drum : ISPERC(ch) ? gs_perc : gs_inst;
-  bank = channel[ch].controller[CTL_BANK_SELECT];
+  struct gsvoices *gs = key ? gs_drum : SYNPERC(synth, ch) ? gs_perc : gs_inst;
+  bank = synth->channel[ch].controller[CTL_BANK_SELECT];
   bank <<= 7;
-  bank |= channel[ch].controller[CTL_BANK_SELECT + CTL_LSB];
+  bank |= synth->channel[ch].controller[CTL_BANK_SELECT + CTL_LSB];
   if (key != 0) {
-    pgm = channel[ch].program;
+    pgm = synth->channel[ch].program;
   }
   for (i = 0; gs[i].name != NULL; i++) {
     if (gs[i].pgm <= pgm) {
@@ -119,73 +118,56 @@ static char *gsfind(int pgm, int ch, int key)
   return rv;
 }
 
-int cdeltat(t1, t2)
-struct timeval *t1;
-struct timeval *t2;
-{
-    int d1, d2;
-
-    d1 = t1->tv_sec - t2->tv_sec;
-    if((d2 = t1->tv_usec - t2->tv_usec) < 0)
-	(d2 += 1000000, d1 -= 1);
-    d2 /= 10000;
-    return (d2 + d1 * 100);
-}
 int updatestatus()
 {
     int ch, d1, d2;
 
-    want_time.tv_sec = start_time.tv_sec + (ticks / 1000);
-    want_time.tv_usec = start_time.tv_usec + (ticks % 1000) * 1000;
-    if (want_time.tv_usec > 1000000)
-	(want_time.tv_usec -= 1000000, want_time.tv_sec++);
-
-    do {
-	attrset(A_BOLD);
-	if ((ch = getch()) != ERR)
-	    switch (ch) {
-	    case KEY_RIGHT:
-		if ((skew -= 0.01) < 0.25)
-		    skew = 0.25;
-		if (graphics)
-		    mvprintw(1, COLS - 6, "%0.2f", skew);
-		break;
-	    case KEY_LEFT:
-		if ((skew += 0.01) > 4)
-		    skew = 4.0;
-		if (graphics)
-		    mvprintw(1, COLS - 6, "%0.2f", skew);
-		break;
-	    case KEY_PPAGE:
-	    case KEY_UP:
-		seq_reset(1);
-		return (ch == KEY_UP ? 0 : -1);
-		break;
-	    case 18:
-	    case 12:
-            case KEY_RESIZE:
-		wrefresh(curscr);
-		break;
-	    case 'q':
-	    case 'Q':
-	    case 3:
-		close_show(0);
-		break;
-	    default:
-		return 1;	/* skip to next song */
-		break;
-	    }
-	gettimeofday(&now_time, NULL);
-	d1 = now_time.tv_sec - start_time.tv_sec;
-	d2 = now_time.tv_usec - start_time.tv_usec;
-	if (d2 < 0)
-	    (d2 += 1000000, d1 -= 1);
-	mvprintw(1, 0, "%02d:%02d.%d", d1 / 60, d1 % 60, d2 / 100000);
-	refresh();
-	d1 = cdeltat(&want_time, &now_time);
-	if (0 && d1 > 10)
-	    usleep(100000);
-    } while (1 && d1 > 30);
+    /* playevents() paces the song, this only polls keys and the clock */
+    attrset(A_BOLD);
+    if ((ch = getch()) != ERR)
+	switch (ch) {
+	case KEY_RIGHT:
+	    if ((synth->skew -= 0.01) < 0.25)
+		synth->skew = 0.25;
+	    if (graphics)
+		mvprintw(1, COLS - 6, "%0.2f", synth->skew);
+	    break;
+	case KEY_LEFT:
+	    if ((synth->skew += 0.01) > 4)
+		synth->skew = 4.0;
+	    if (graphics)
+		mvprintw(1, COLS - 6, "%0.2f", synth->skew);
+	    break;
+	case KEY_PPAGE:
+	case KEY_UP:
+	    seq_reset(synth, 1);
+	    return (ch == KEY_UP ? 0 : -1);
+	    break;
+	case 18:
+	case 12:
+	case KEY_RESIZE:
+	    wrefresh(curscr);
+	    break;
+	case 'q':
+	case 'Q':
+	case 3:
+	    close_show(0);
+	    break;
+	default:
+	    return 1;	/* skip to next song */
+	    break;
+	}
+    gettimeofday(&now_time, NULL);
+    d1 = now_time.tv_sec - start_time.tv_sec;
+    d2 = now_time.tv_usec - start_time.tv_usec;
+    if (d2 < 0)
+	(d2 += 1000000, d1 -= 1);
+    mvprintw(1, 0, "%02d:%02d.%d", d1 / 60, d1 % 60, d2 / 100000);
+    if (verbose) {
+	int peak, depth = seq_queue_depth(synth, &peak);
+	mvprintw(1, 29, "q%4d/%-4d", depth, peak);
+    }
+    refresh();
     return NO_EXIT;
 }
 
@@ -277,13 +259,13 @@ int length;
 	    if (graphics)
 		if (VEL) {
 		    attrset(A_BOLD | COLOR_PAIR((CHN(cmd) % 6 + 1)));
-		    if (!ISPERC(CHN(cmd)) || NOTE == 0)
+		    if (!SYNPERC(synth, CHN(cmd)) || NOTE == 0)
 			mvprintw(YPOS, XPOS, "%s%c", NNAME, OCHAR);
 		    else
 			mvprintw(YPOS, PXPOS, "%8.8s",
                                  gsfind(0, CHN(cmd), NOTE));
 		} else {
-                  if (!ISPERC(CHN(cmd))) {
+                  if (!SYNPERC(synth, CHN(cmd))) {
 		    mvaddstr(YPOS, XPOS, "   ");
                   } else {
 		    mvaddstr(YPOS, PXPOS, "        ");
@@ -295,7 +277,7 @@ int length;
 	    break;
 	case MIDI_NOTEOFF:
 	    if (graphics) {
-                  if (!ISPERC(CHN(cmd))) {
+                  if (!SYNPERC(synth, CHN(cmd))) {
 		    mvaddstr(YPOS, XPOS, "   ");
                   } else {
 		    mvaddstr(YPOS, PXPOS, "        ");
@@ -371,8 +353,8 @@ void init_show()
 	mvprintw(0, 40, "Now Playing:");
 	mvprintw(1, 40, "[P]ause [N]ext [L]ast [O]ptions");
 	mvaddstr(ytxt, 0, "=-=-=-=-=-=-=-");
-	mvprintw(1, 0, "00:00.0 - 00:00.0, %d track%c", ntrks,
-		 ntrks > 1 ? 's' : ' ');
+	mvprintw(1, 0, "00:00.0 - 00:00.0, %d track%c", song.ntrks,
+		 song.ntrks > 1 ? 's' : ' ');
 	for (i = 0; i < 16; i++)
 	    mvprintw(i + 2, 0, "Channel %2d   |", i + 1);
 	tmp = strrchr(filename, '/');
@@ -387,8 +369,8 @@ void init_show()
 	refresh();
     } else if (verbose) {
 	printf("** Now Playing \"%s\"\n", filename);
-	printf("** Format: %d, Tracks: %d, Division: %d\n", format,
-	       ntrks, division);
+	printf("** Format: %d, Tracks: %d, Division: %d\n", song.format,
+	       song.ntrks, song.division);
     }
 }
 
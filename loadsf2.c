@@ -13,38 +13,61 @@
 #include "soundfont2.h"
 
 #include <stdio.h>
+#include <stddef.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-struct sfSFBK sf2;  /* pointers to everything loaded go here */
 extern int verbose;
+extern int cache_mb;
 
-/* for each tag value found, describe where to stick a pointer to the data */
-struct fillSFBK { char *tag; void *dest; };
+/* for each tag value found, describe where in sfSFBK to stick a pointer */
+#define FILL(x) { #x, offsetof(struct sfSFBK, x) }
+struct fillSFBK { char *tag; size_t dest; };
 struct fillSFBK filldata[] = {
-  { "ifil", &sf2.ifil }, { "isng", &sf2.isng }, { "INAM", &sf2.INAM },
-  { "irom", &sf2.irom }, { "iver", &sf2.iver }, { "ICRD", &sf2.ICRD },
-  { "IENG", &sf2.IENG }, { "IPRD", &sf2.IPRD }, { "ICOP", &sf2.ICOP },
-  { "ICMT", &sf2.ICMT }, { "ISFT", &sf2.ISFT }, { "smpl", &sf2.smpl },
-  { "sm24", &sf2.sm24 }, { "phdr", &sf2.phdr }, { "pbag", &sf2.pbag },
-  { "pmod", &sf2.pmod }, { "pgen", &sf2.pgen }, { "inst", &sf2.inst },
-  { "ibag", &sf2.ibag }, { "imod", &sf2.imod }, { "igen", &sf2.igen },
-  { "shdr", &sf2.shdr }, { NULL, NULL }
+  FILL(ifil), FILL(isng), FILL(INAM), FILL(irom), FILL(iver), FILL(ICRD),
+  FILL(IENG), FILL(IPRD), FILL(ICOP), FILL(ICMT), FILL(ISFT), FILL(smpl),
+  FILL(sm24), FILL(phdr), FILL(pbag), FILL(pmod), FILL(pgen), FILL(inst),
+  FILL(ibag), FILL(imod), FILL(igen), FILL(shdr), { NULL, 0 }
 };
 
-static void fill_sf2(Uint32 tag, void *buf, Uint32 size)
+/* compiled bank file, see save_bank(): a bankHeader, then each section */
+/* it lists, an sfSFBK array as read_sf2() builds it in host byte order */
+#define BANK_VERSION 1
+#define BANK_ALIGN 65536        /* sample data starts on a page of any size */
+struct fillSFBK bankdata[] = {
+  FILL(INAM), FILL(phdr), FILL(shdr), FILL(zone), FILL(zgen), FILL(zkey),
+  FILL(zlist), FILL(smpl), { NULL, 0 }
+};
+#define BANK_SECTIONS (sizeof(bankdata) / sizeof(bankdata[0]) - 1)
+struct bankHeader {
+  Uint32 magic;                 // "pmbk", also tells the byte order apart
+  Uint32 version;               // BANK_VERSION, banks of others are refused
+  Uint32 tag[BANK_SECTIONS];    // which sfSFBK array each section holds
+  Uint32 size[BANK_SECTIONS];   // size of the section in bytes
+  Uint64 offset[BANK_SECTIONS]; // where in the file it starts
+};
+
+static void fill_sf2(struct sfSFBK *sf2, struct fillSFBK *fill, Uint32 tag,
+                     void *buf, Uint32 size)
 {
   int i;
-  for (i = 0; filldata[i].tag != NULL && filldata[i].dest != NULL; i++) {
-    if (*(Uint32 *)filldata[i].tag == tag) {
-      memcpy(filldata[i].dest, &buf, sizeof(void *));
-      memcpy(sizeof(void *) + filldata[i].dest, &size, sizeof(Uint32));
+  for (i = 0; fill[i].tag != NULL; i++) {
+    if (*(Uint32 *)fill[i].tag == tag) {
+      Uint8 *dest = (Uint8 *)sf2 + fill[i].dest;
+      memcpy(dest, &buf, sizeof(void *));
+      memcpy(dest + sizeof(void *), &size, sizeof(Uint32));
       return;
     }
   }
   fprintf(stderr, "Unhandled %.4s in sf2 file.\n", (char *)&tag);
 }
 
-static void parse_subchunk(struct riffChunk *parent, Uint32 level)
+static void parse_subchunk(struct sfSFBK *sf2, struct riffChunk *parent,
+                           Uint32 level)
 {
   Uint32 offset = 4;  /* skip the data tag */
   struct riffChunk *buf = (struct riffChunk *)(parent->data + offset);
@@ -53,79 +76,688 @@ static void parse_subchunk(struct riffChunk *parent, Uint32 level)
     fprintf(stderr, "ignored unexpectedly deep recursion in RIFF file\n");
     return;
   }
-  while (parent->len - offset >= sizeof(struct riffChunk)) {
+  while (offset + sizeof(struct riffChunk) <= parent->len) {
     buf = (struct riffChunk *)(parent->data + offset);
+    if (buf->len > parent->len - offset - sizeof(struct riffChunk)) {
+      fprintf(stderr, "ignored truncated %.4s chunk in RIFF file\n",
+              (char *)&buf->tag);
+      return;  /* the file is mapped, don't read past its end */
+    }
     if (0) {
       fprintf(stderr, "%*sTAG = %.4s LEN = %d\n", 2 + level * 2, "",
               (char *)&buf->tag, buf->len);
     }
     if (buf->tag == SDL_SwapBE32('LIST')) {
-      parse_subchunk(buf, level + 1);  /* look for chunks inside this chunk */
+      parse_subchunk(sf2, buf, level + 1);  /* look for chunks inside */
     } else {
-      fill_sf2(buf->tag, &buf->data, buf->len);
+      fill_sf2(sf2, filldata, buf->tag, &buf->data, buf->len);
     }
     offset += sizeof(struct riffChunk) + buf->len;
   }
   return;
 }
 
-/* load soundfont2 riff file into sf2 struct, return pointer to raw riff data */
-struct riffChunk *load_sf2(char *filename)
+/* frames needed to cache sample h, or 0 if it can't be cached */
+static Uint32 cache_len(struct sfSFBK *sf2, struct sfSample *h)
+{
+  if (h->dwStart >= h->dwEnd || h->dwEnd > sf2->smpl_size / sizeof(short) ||
+      (h->sfSampleType & 0x8000)) {
+    return 0;  // bad range or rom sample
+  }
+  return h->dwEnd - h->dwStart + CACHE_GUARD;
+}
+
+/* set aside room for a normalized float copy of each sample, as long */
+/* as it fits in cache_mb megabytes.  the copies are made by */
+/* cache_sample() when first queued, and the room for the others is */
+/* address space only, so samples never played cost no memory */
+static void build_cache(struct sfSFBK *sf2)
+{
+  int i, nshdr = sf2->shdr_size / sizeof(struct sfSample) - 1;
+  int ncached = 0;
+  Uint32 budget = (Uint32)cache_mb << 18;  // in floats
+  Uint32 len, used = 0;
+  float *data;
+
+  sf2->cache = NULL;
+  sf2->cache_size = 0;
+  if (!sf2->smpl || nshdr < 1 || cache_mb <= 0) {
+    return;
+  }
+  for (i = 0; i < nshdr; i++) {
+    if ((len = cache_len(sf2, &sf2->shdr[i])) && used + len <= budget) {
+      used += len;
+    }
+  }
+  if (!used) {
+    return;
+  }
+  if (!(sf2->cache = calloc(nshdr, sizeof(struct sfCache))) ||
+      !(data = malloc(used * sizeof(float)))) {
+    perror("malloc");
+    free(sf2->cache);
+    sf2->cache = NULL;
+    return;
+  }
+  sf2->cache_size = used * sizeof(float);
+  for (used = i = 0; i < nshdr; i++) {
+    struct sfSample *h = &sf2->shdr[i];
+    struct sfCache *c = &sf2->cache[i];
+    if (!(len = cache_len(sf2, h)) || used + len > budget) {
+      continue;
+    }
+    c->data = &data[used];
+    used += len;
+    c->loop = h->dwStartloop >= h->dwStart && h->dwEndloop <= h->dwEnd &&
+              h->dwEndloop >= h->dwStartloop + CACHE_GUARD &&
+              h->dwEndloop >= h->dwStart + CACHE_GUARD;
+    ncached++;
+  }
+  if (verbose) {
+    fprintf(stderr, "float cache: room for %d of %d samples, "
+            "%u of %u kbytes\n", ncached, nshdr, sf2->cache_size >> 10,
+            budget >> 8);
+  }
+}
+
+/* float cache entry of sample i with room set aside, filled the first */
+/* time a note is queued for it.  a guard of silence follows the end */
+/* of the sample and the seam holds the frames around the loop point, */
+/* so voices using the cache can read all four interpolation taps */
+/* without any checks.  called on the producer side only, never from */
+/* the audio callback; synths share the soundfont, so a producer */
+/* finding another thread filling the same sample waits the short */
+/* while it takes */
+struct sfCache *cache_sample(struct sfSFBK *sf2, int i)
 {
-  SDL_RWops *rw = SDL_RWFromFile(filename, "r");
-  Uint32 tag, len;
-  Sint64 size;
-  struct riffChunk *buf = NULL;
-  int error = 0;
+  struct sfCache *c = &sf2->cache[i];
+  struct sfSample *h = &sf2->shdr[i];
+  int empty = 0;
+  Uint32 k, len;
+
+  if (atomic_load_explicit(&c->state, memory_order_acquire) == 2) {
+    return c;
+  }
+  if (!atomic_compare_exchange_strong(&c->state, &empty, 1)) {
+    while (atomic_load_explicit(&c->state, memory_order_acquire) != 2) {
+      SDL_Delay(0);
+    }
+    return c;
+  }
+  len = h->dwEnd - h->dwStart;
+  for (k = 0; k < len; k++) {
+    c->data[k] = (float)sf2->smpl[h->dwStart + k] * (1.0 / 32767.0);
+  }
+  for (k = 0; k < CACHE_GUARD; k++) {
+    c->data[len + k] = 0.0;  // silence past the true end
+  }
+  if (c->loop) {
+    for (k = 0; k < CACHE_GUARD; k++) {
+      c->seam[k] = c->data[h->dwEndloop - CACHE_GUARD + k - h->dwStart];
+      c->seam[CACHE_GUARD + k] = c->data[h->dwStartloop + k - h->dwStart];
+    }
+  }
+  atomic_store_explicit(&c->state, 2, memory_order_release);
+  return c;
+}
 
-  if (!rw) {
+/* make room for element count of a growing array of size byte elements */
+static void *grow(void *array, Uint32 count, size_t size)
+{
+  if (count == 0 || (count >= 16 && !(count & (count - 1)))) {
+    if (!(array = realloc(array, (count < 16 ? 16 : count * 2) * size))) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  return array;
+}
+
+/* append generators lo to hi of gen to sf2->zgen, leaving out the ones */
+/* that only select zones and those that are not valid at preset level */
+static void add_gens(struct sfSFBK *sf2, struct sfGenList *gen, int lo,
+                     int hi, int preset_level)
+{
+  Uint32 n = sf2->zgen_size / sizeof(struct sfGenList);
+  int p;
+
+  for (p = lo; p < hi; p++) {
+    switch (gen[p].sfGenOper) {
+      case SFG_keyRange:
+      case SFG_velRange:
+      case SFG_instrument:
+      case SFG_sampleID:
+        continue;
+      case SFG_startAddrsOffset:
+      case SFG_endAddrsOffset:
+      case SFG_startloopAddrsOffset:
+      case SFG_endloopAddrsOffset:
+      case SFG_startAddrsCoarseOffset:
+      case SFG_endAddrsCoarseOffset:
+      case SFG_startloopAddrsCoarseOffset:
+      case SFG_keynum:
+      case SFG_velocity:
+      case SFG_endloopAddrsCoarseOffset:
+      case SFG_sampleModes:
+      case SFG_exclusiveClass:
+      case SFG_overridingRootKey:
+        if (preset_level) continue;  // not valid at this level
+        break;
+      default:
+        break;
+    }
+    sf2->zgen = grow(sf2->zgen, n, sizeof(struct sfGenList));
+    sf2->zgen[n] = gen[p];
+    /* clamp here rather than at note on: a compiled bank is read only */
+    if (gen[p].sfGenOper == SFG_sustainVolEnv) {
+      sf2->zgen[n].genAmount.shAmount = SDL_min(gen[p].genAmount.shAmount,
+                                                1440);
+    }
+    if (gen[p].sfGenOper == SFG_initialAttenuation) {
+      sf2->zgen[n].genAmount.wAmount = SDL_min(gen[p].genAmount.wAmount,
+                                               1440);
+    }
+    n++;
+  }
+  sf2->zgen_size = n * sizeof(struct sfGenList);
+}
+
+/* append a region to sf2->zone, generators are added after this call */
+static void add_zone(struct sfSFBK *sf2, int keylo, int keyhi, int vello,
+                     int velhi, int shdr)
+{
+  Uint32 n = sf2->zone_size / sizeof(struct sfZone);
+
+  sf2->zone = grow(sf2->zone, n, sizeof(struct sfZone));
+  sf2->zone[n].keylo = keylo;
+  sf2->zone[n].keyhi = keyhi;
+  sf2->zone[n].vello = vello;
+  sf2->zone[n].velhi = velhi;
+  sf2->zone[n].shdr = shdr;
+  sf2->zone[n].gen = sf2->zone[n].gen_max =
+    sf2->zgen_size / sizeof(struct sfGenList);
+  sf2->zone_size = (n + 1) * sizeof(struct sfZone);
+}
+
+/* scan the generators of one zone for its key and velocity range and */
+/* the index of its terminal generator (instrument or sampleID), or -1 */
+static int zone_range(struct sfGenList *gen, int lo, int hi, int terminal,
+                      int *range)
+{
+  int p;
+
+  range[0] = range[2] = 0;
+  range[1] = range[3] = 127;
+  for (p = lo; p < hi; p++) {
+    if (gen[p].sfGenOper == SFG_keyRange) {
+      range[0] = gen[p].genAmount.ranges.byLo;
+      range[1] = gen[p].genAmount.ranges.byHi;
+    }
+    if (gen[p].sfGenOper == SFG_velRange) {
+      range[2] = gen[p].genAmount.ranges.byLo;
+      range[3] = gen[p].genAmount.ranges.byHi;
+    }
+    if (gen[p].sfGenOper == terminal) {
+      return gen[p].genAmount.wAmount;
+    }
+  }
+  return -1;
+}
+
+/* add a region for each zone of instrument i that overlaps the key and */
+/* velocity range pr of the preset zone with generators plo to phi */
+static void add_inst_zones(struct sfSFBK *sf2, int i, int *pr, int pglo,
+                           int pghi, int plo, int phi)
+{
+  int nshdr = sf2->shdr_size / sizeof(struct sfSample) - 1;
+  int nibag = sf2->ibag_size / sizeof(struct sfInstBag) - 1;
+  int nigen = sf2->igen_size / sizeof(struct sfInstGenList);
+  struct sfGenList *igen = (struct sfGenList *)sf2->igen;
+  int iz, s, ir[4];
+  int iglo = 0, ighi = 0;  // generators of the global instrument zone
+
+  for (iz = sf2->inst[i].wInstBagNdx;
+       iz < sf2->inst[i + 1].wInstBagNdx && iz < nibag; iz++) {
+    int ilo = sf2->ibag[iz].wInstGenNdx, ihi = sf2->ibag[iz + 1].wInstGenNdx;
+    if (ihi > nigen) {
+      break;
+    }
+    s = zone_range(igen, ilo, ihi, SFG_sampleID, ir);
+    if (s < 0) {
+      if (iz == sf2->inst[i].wInstBagNdx) {
+        iglo = ilo;  // first zone without a sample is global
+        ighi = ihi;
+      }
+      continue;
+    }
+    if (s >= nshdr || SDL_max(pr[0], ir[0]) > SDL_min(pr[1], ir[1]) ||
+        SDL_max(pr[2], ir[2]) > SDL_min(pr[3], ir[3])) {
+      continue;  // bad sample or ranges that never overlap
+    }
+    add_zone(sf2, SDL_max(pr[0], ir[0]), SDL_min(pr[1], ir[1]),
+             SDL_max(pr[2], ir[2]), SDL_min(pr[3], ir[3]), s);
+    add_gens(sf2, sf2->pgen, pglo, pghi, 1);
+    add_gens(sf2, sf2->pgen, plo, phi, 1);
+    add_gens(sf2, igen, iglo, ighi, 0);
+    add_gens(sf2, igen, ilo, ihi, 0);
+    sf2->zone[sf2->zone_size / sizeof(struct sfZone) - 1].gen_max =
+      sf2->zgen_size / sizeof(struct sfGenList);
+  }
+}
+
+/* flatten every preset into the list of regions a note on can match. */
+/* each instrument zone of each preset zone becomes one region with the */
+/* combined key and velocity range and all generators that apply to it, */
+/* followed by a silent region with the preset zone's range for notes */
+/* none of its instrument zones cover.  taking the first region that */
+/* matches then gives the same voice as walking phdr, pbag and ibag. */
+/* zlist holds, for every preset and key, the regions that include it */
+static void compile_zones(struct sfSFBK *sf2)
+{
+  int nphdr = sf2->phdr_size / sizeof(struct sfPresetHeader) - 1;
+  int ninst = sf2->inst_size / sizeof(struct sfInst) - 1;
+  int npbag = sf2->pbag_size / sizeof(struct sfPresetBag) - 1;
+  int ngen = sf2->pgen_size / sizeof(struct sfGenList);
+  Uint32 first, nlist = 0;
+  int i, k, p, pz, pr[4];
+
+  if (!(sf2->zkey = malloc(nphdr * 129 * sizeof(Uint32)))) {
+    perror("malloc");
+    exit(1);
+  }
+  sf2->zkey_size = nphdr * 129 * sizeof(Uint32);
+  for (p = 0; p < nphdr; p++) {
+    int pglo = 0, pghi = 0;  // generators of the global preset zone
+    first = sf2->zone_size / sizeof(struct sfZone);
+    for (pz = sf2->phdr[p].wPresetBagNdx;
+         pz < sf2->phdr[p + 1].wPresetBagNdx && pz < npbag; pz++) {
+      int plo = sf2->pbag[pz].wGenNdx, phi = sf2->pbag[pz + 1].wGenNdx;
+      if (phi > ngen) {
+        break;
+      }
+      i = zone_range(sf2->pgen, plo, phi, SFG_instrument, pr);
+      if (i < 0) {
+        if (pz == sf2->phdr[p].wPresetBagNdx) {
+          pglo = plo;  // first zone without an instrument is global
+          pghi = phi;
+        }
+        continue;
+      }
+      if (i < ninst) {
+        add_inst_zones(sf2, i, pr, pglo, pghi, plo, phi);
+      }
+      add_zone(sf2, pr[0], pr[1], pr[2], pr[3], -1);
+    }
+    for (k = 0; k < 128; k++) {
+      sf2->zkey[p * 129 + k] = nlist;
+      for (i = first; i < sf2->zone_size / sizeof(struct sfZone); i++) {
+        if (sf2->zone[i].keylo <= k && sf2->zone[i].keyhi >= k) {
+          sf2->zlist = grow(sf2->zlist, nlist, sizeof(Uint32));
+          sf2->zlist[nlist++] = i;
+        }
+      }
+    }
+    sf2->zkey[p * 129 + 128] = nlist;
+  }
+  sf2->zlist_size = nlist * sizeof(Uint32);
+  if (verbose) {
+    fprintf(stderr, "zone map: %u regions, %u kbytes\n",
+            (Uint32)(sf2->zone_size / sizeof(struct sfZone)),
+            (sf2->zone_size + sf2->zgen_size + sf2->zkey_size +
+             sf2->zlist_size) >> 10);
+  }
+}
+
+/* free a soundfont from read_sf2() and everything built from it */
+static void free_sf2(struct sfSFBK *sf2)
+{
+  int i, nshdr;
+
+  if (!sf2) {
+    return;
+  }
+  if (sf2->cache) {
+    /* the cached samples share one block, starting at the first one */
+    nshdr = sf2->shdr_size / sizeof(struct sfSample) - 1;
+    for (i = 0; i < nshdr && !sf2->cache[i].data; i++);
+    if (i < nshdr) {
+      free(sf2->cache[i].data);
+    }
+    free(sf2->cache);
+  }
+  if (!sf2->compiled) {
+    free(sf2->zone);
+    free(sf2->zgen);
+    free(sf2->zkey);
+    free(sf2->zlist);
+  }
+  if (sf2->map) {
+    munmap(sf2->map, sf2->map_size);
+  }
+  free(sf2);
+}
+
+/* check every index the engine follows from one section of a compiled */
+/* bank into another, and the sample ranges, against the section sizes. */
+/* returns nonzero if a note on could read outside of them */
+static int check_bank(struct sfSFBK *sf2)
+{
+  Uint32 nshdr = sf2->shdr_size / sizeof(struct sfSample) - 1;
+  Uint32 nzone = sf2->zone_size / sizeof(struct sfZone);
+  Uint32 nzgen = sf2->zgen_size / sizeof(struct sfGenList);
+  Uint32 nzkey = sf2->zkey_size / sizeof(Uint32);
+  Uint32 nzlist = sf2->zlist_size / sizeof(Uint32);
+  Uint32 nsmpl = sf2->smpl_size / sizeof(short);
+  Uint32 i;
+
+  for (i = 0; i < nzkey; i++) {
+    if (sf2->zkey[i] > nzlist || (i > 0 && sf2->zkey[i] < sf2->zkey[i - 1])) {
+      return -1;
+    }
+  }
+  for (i = 0; i < nzlist; i++) {
+    if (sf2->zlist[i] >= nzone) {
+      return -1;
+    }
+  }
+  for (i = 0; i < nzone; i++) {
+    struct sfZone *z = &sf2->zone[i];
+    if (z->shdr >= (int)nshdr || z->gen > z->gen_max || z->gen_max > nzgen) {
+      return -1;
+    }
+  }
+  for (i = 0; i < nshdr; i++) {
+    struct sfSample *h = &sf2->shdr[i];
+    if (h->dwStart > h->dwEnd || h->dwEnd >= nsmpl ||
+        h->dwStartloop > h->dwEndloop || h->dwEndloop >= nsmpl) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* point sf2 at the sections of the compiled bank mapped for it.  the */
+/* zone map comes ready made, so this takes the same short time however */
+/* big or complex the soundfont was */
+static struct sfSFBK *read_bank(struct sfSFBK *sf2, char *filename)
+{
+  struct bankHeader *hdr = sf2->map;
+  Uint32 nphdr;
+  int i;
+
+  if (hdr->version != BANK_VERSION) {
+    fprintf(stderr, "%s: bank version %u, not %u, compile it again with -K\n",
+            filename, hdr->version, BANK_VERSION);
+    free_sf2(sf2);
+    return NULL;
+  }
+  sf2->compiled = 1;
+  for (i = 0; i < BANK_SECTIONS; i++) {
+    if (hdr->offset[i] % 8 || hdr->offset[i] > sf2->map_size ||
+        hdr->size[i] > sf2->map_size - hdr->offset[i]) {
+      break;
+    }
+    fill_sf2(sf2, bankdata, hdr->tag[i], (Uint8 *)sf2->map + hdr->offset[i],
+             hdr->size[i]);
+  }
+  nphdr = sf2->phdr_size / sizeof(struct sfPresetHeader) - 1;
+  if (i < BANK_SECTIONS || nphdr < 1 ||
+      sf2->shdr_size < sizeof(struct sfSample) * 2 ||
+      sf2->zkey_size != nphdr * 129 * sizeof(Uint32) || check_bank(sf2)) {
+    fprintf(stderr, "%s: malformed bank file, ignoring\n", filename);
+    free_sf2(sf2);
+    return NULL;
+  }
+  build_cache(sf2);
+  if (verbose) {
+    fprintf(stderr, "zone map: %u regions, from compiled bank\n",
+            (Uint32)(sf2->zone_size / sizeof(struct sfZone)));
+  }
+  return sf2;
+}
+
+/* map soundfont2 riff file, return a new sf2 struct pointing into it. */
+/* only the chunk headers and the hydra are read here, the pages of the */
+/* sample data are left to be read in as voices play them */
+static struct sfSFBK *read_sf2(char *filename)
+{
+  struct riffChunk *buf;
+  struct sfSFBK *sf2;
+  struct stat st;
+  Uint8 *map;
+  off_t offset = 0;
+  int fd, error = 0;
+
+  if ((fd = open(filename, O_RDONLY)) < 0) {
     if (verbose)
       perror(filename);
     return NULL;
   }
-  size = SDL_RWsize(rw);
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct riffChunk)) {
+    fprintf(stderr, "%s: not a soundfont\n", filename);
+    close(fd);
+    return NULL;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);  /* the mapping keeps the file */
+  if (map == MAP_FAILED) {
+    perror(filename);
+    return NULL;
+  }
+  if (!(sf2 = calloc(1, sizeof(struct sfSFBK)))) {
+    perror("calloc");
+    munmap(map, st.st_size);
+    return NULL;
+  }
+  sf2->map = map;
+  sf2->map_size = st.st_size;
+  if (st.st_size >= sizeof(struct bankHeader) &&
+      ((struct bankHeader *)map)->magic == SDL_SwapBE32('pmbk')) {
+    return read_bank(sf2, filename);
+  }
   /* at the top level there should only be one chunk */
   /* but loop anyway in case someone concatenated riff files */
-  while (size >= sizeof(struct riffChunk)) {
-    tag = SDL_ReadLE32(rw);
-    len = SDL_ReadLE32(rw);
-    if (!(buf = malloc(sizeof(struct riffChunk) + len))) {
-      perror("malloc");
-      return NULL;
-    }
-    buf->tag = tag;
-    buf->len = len;
-    if (SDL_RWread(rw, buf->data, len, 1) < 1) {
-      /* done reading the file, or read in error */
-      free(buf);
+  while (st.st_size - offset >= sizeof(struct riffChunk)) {
+    buf = (struct riffChunk *)(map + offset);
+    if (buf->len > st.st_size - offset - sizeof(struct riffChunk)) {
+      fprintf(stderr, "%s: truncated sf2 file, ignoring\n", filename);
+      free_sf2(sf2);
       return NULL;
     }
     if (0) {
       fprintf(stderr, "TAG = %.4s LEN = %d\n", (char *)&buf->tag, buf->len);
     }
-    if (*(Uint32 *)buf->data == SDL_SwapBE32('sfbk')) {
-      parse_subchunk(buf, 0);  /* look for chunks inside this chunk */
+    if (buf->len >= 4 && *(Uint32 *)buf->data == SDL_SwapBE32('sfbk')) {
+      parse_subchunk(sf2, buf, 0);  /* look for chunks inside this chunk */
+      sf2->riff = buf;
     }
-    size -= sizeof(struct riffChunk) + buf->len;
+    offset += sizeof(struct riffChunk) + buf->len;
   };
-  SDL_RWclose(rw);
-  if (sf2.phdr_size < sizeof(struct sfPresetHeader) * 2) { error++; }
-  if (sf2.pbag_size < sizeof(struct sfPresetBag) * 2) { error++; }
-  if (sf2.pgen_size < sizeof(struct sfGenList) * 2) { error++; }
-  if (sf2.inst_size < sizeof(struct sfInst) * 2) { error++; }
-  if (sf2.igen_size < sizeof(struct sfInstGenList) * 2) { error++; }
-  if (sf2.shdr_size < sizeof(struct sfSample) * 2) { error++; }
+  if (sf2->phdr_size < sizeof(struct sfPresetHeader) * 2) { error++; }
+  if (sf2->pbag_size < sizeof(struct sfPresetBag) * 2) { error++; }
+  if (sf2->pgen_size < sizeof(struct sfGenList) * 2) { error++; }
+  if (sf2->inst_size < sizeof(struct sfInst) * 2) { error++; }
+  if (sf2->igen_size < sizeof(struct sfInstGenList) * 2) { error++; }
+  if (sf2->shdr_size < sizeof(struct sfSample) * 2) { error++; }
   if (error) {
     fprintf(stderr, "%s: malformed sf2 file, ignoring\n", filename);
-    memset(&sf2, 0, sizeof(sf2));
-    free(buf);
+    free_sf2(sf2);
+    return NULL;
+  }
+  build_cache(sf2);
+  compile_zones(sf2);
+  return sf2;
+}
+
+/* compile soundfont2 file into bank file bankname, so that loading it */
+/* is little more than mapping it.  0 if done, < 0 if not */
+int save_bank(char *filename, char *bankname)
+{
+  struct bankHeader hdr;
+  struct sfSFBK *sf2;
+  char tmpname[FILENAME_MAX];
+  Uint64 offset = sizeof(hdr);
+  SDL_RWops *rw;
+  Uint8 *dest;
+  void *data;
+  int i, error = 0;
+
+  if (!(sf2 = read_sf2(filename))) {
+    fprintf(stderr, "%s: can't read sf2 file\n", filename);
+    return -1;
+  }
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = SDL_SwapBE32('pmbk');
+  hdr.version = BANK_VERSION;
+  for (i = 0; i < BANK_SECTIONS; i++) {
+    hdr.tag[i] = *(Uint32 *)bankdata[i].tag;
+    dest = (Uint8 *)sf2 + bankdata[i].dest;
+    memcpy(&hdr.size[i], dest + sizeof(void *), sizeof(Uint32));
+    offset = (offset + 7) & ~7;
+    if (bankdata[i].dest == offsetof(struct sfSFBK, smpl)) {
+      offset = (offset + BANK_ALIGN - 1) & ~(Uint64)(BANK_ALIGN - 1);
+    }
+    hdr.offset[i] = offset;
+    offset += hdr.size[i];
+  }
+  /* write it under another name and rename it over the old bank, which */
+  /* players may have mapped, only when it is complete */
+  snprintf(tmpname, sizeof(tmpname), "%s.tmp", bankname);
+  if (!(rw = SDL_RWFromFile(tmpname, "wb"))) {
+    perror(tmpname);
+    free_sf2(sf2);
+    return -1;
+  }
+  if (SDL_RWwrite(rw, &hdr, sizeof(hdr), 1) < 1) {
+    error++;
+  }
+  for (i = 0; i < BANK_SECTIONS && !error; i++) {
+    dest = (Uint8 *)sf2 + bankdata[i].dest;
+    memcpy(&data, dest, sizeof(void *));
+    if (hdr.size[i] && (SDL_RWseek(rw, hdr.offset[i], RW_SEEK_SET) < 0 ||
+        SDL_RWwrite(rw, data, hdr.size[i], 1) < 1)) {
+      error++;
+    }
+  }
+  if (SDL_RWclose(rw) < 0 || error || rename(tmpname, bankname) < 0) {
+    perror(bankname);
+    remove(tmpname);
+    free_sf2(sf2);
+    return -1;
+  }
+  if (verbose) {
+    fprintf(stderr, "%s: compiled to %s, %lu kbytes\n", filename, bankname,
+            (unsigned long)(offset >> 10));
+  }
+  free_sf2(sf2);
+  return 0;
+}
+
+/* a loaded soundfont is never written to but for the float cache, */
+/* whose entries cache_sample() hands over atomically, so every synth */
+/* can share it */
+struct sharedSF2 {
+  struct sfSFBK *sf2;
+  dev_t dev;                    // identity of the file it was read from,
+  ino_t ino;                    // a rewritten file is loaded again
+  off_t size;
+  time_t mtime;
+  int refs;                     // load_sf2() calls not yet released
+  struct sharedSF2 *next;
+};
+static struct sharedSF2 *shared;
+static SDL_SpinLock shared_lock;
+
+/* reference the loaded copy of file st if any, call with shared_lock held */
+static struct sharedSF2 *find_shared(struct stat *st)
+{
+  struct sharedSF2 *b;
+
+  for (b = shared; b; b = b->next) {
+    if (b->dev == st->st_dev && b->ino == st->st_ino &&
+      b->size == st->st_size && b->mtime == st->st_mtime) {
+      b->refs++;
+      return b;
+    }
+  }
+  return NULL;
+}
+
+/* load soundfont2 file, or share it if it is loaded already */
+struct sfSFBK *load_sf2(char *filename)
+{
+  struct sharedSF2 *b, *other;
+  struct sfSFBK *sf2;
+  struct stat st;
+
+  if (stat(filename, &st) < 0) {
+    if (verbose)
+      perror(filename);
+    return NULL;
+  }
+  SDL_AtomicLock(&shared_lock);
+  b = find_shared(&st);
+  SDL_AtomicUnlock(&shared_lock);
+  if (b) {
+    if (verbose)
+      fprintf(stderr, "%s: sharing loaded soundfont\n", filename);
+    return b->sf2;
+  }
+  /* parse without the lock, a racing load of the same file is dropped */
+  if (!(sf2 = read_sf2(filename))) {
+    return NULL;
+  }
+  if (!(b = calloc(1, sizeof(struct sharedSF2)))) {
+    perror("calloc");
+    free_sf2(sf2);
     return NULL;
   }
-  return buf;
+  SDL_AtomicLock(&shared_lock);
+  if ((other = find_shared(&st))) {
+    SDL_AtomicUnlock(&shared_lock);
+    free_sf2(sf2);
+    free(b);
+    return other->sf2;
+  }
+  b->sf2 = sf2;
+  b->dev = st.st_dev;
+  b->ino = st.st_ino;
+  b->size = st.st_size;
+  b->mtime = st.st_mtime;
+  b->refs = 1;
+  b->next = shared;
+  shared = b;
+  SDL_AtomicUnlock(&shared_lock);
+  return sf2;
+}
+
+/* drop a reference from load_sf2(), the last one frees the soundfont */
+void release_sf2(struct sfSFBK *sf2)
+{
+  struct sharedSF2 **p, *b = NULL;
+
+  if (!sf2) {
+    return;
+  }
+  SDL_AtomicLock(&shared_lock);
+  for (p = &shared; *p; p = &(*p)->next) {
+    if ((*p)->sf2 == sf2) {
+      if (--(*p)->refs == 0) {
+        b = *p;
+        *p = b->next;
+      }
+      break;
+    }
+  }
+  SDL_AtomicUnlock(&shared_lock);
+  if (b) {
+    free_sf2(b->sf2);
+    free(b);
+  }
 }
 
 #ifdef TEST_TARGET
-int verbose = 1;
+int verbose = 1, cache_mb = 256;
 /* stand alone testing of above file parsing */
 int main(int argc, char **argv)
 {
@@ -13,31 +13,26 @@
 #include "playmidi.h"
 #include <sys/time.h>
 
-extern void seq_set_patch(int, int);
-extern void seq_key_pressure(int, int, int);
-extern void seq_start_note(int, int, int);
-extern void seq_stop_note(int, int, int);
-extern void seq_control(int, int, int);
-extern void seq_chn_pressure(int, int);
-extern void seq_bender(int, int, int);
-extern void seq_reset(int);
-extern int graphics, verbose, division, ntrks, format;
+extern void seq_set_patch(struct synth *, int, int);
+extern void seq_key_pressure(struct synth *, int, int, int);
+extern void seq_start_note(struct synth *, int, int, int);
+extern void seq_stop_note(struct synth *, int, int, int);
+extern void seq_control(struct synth *, int, int, int);
+extern void seq_chn_pressure(struct synth *, int, int);
+extern void seq_bender(struct synth *, int, int, int);
+extern void seq_reset(struct synth *, int);
+extern int seq_wait(struct synth *, Uint32, Uint32);
+extern int graphics, verbose;
 extern int perc;
-extern int play_ext, reverb, chorus, chanmask;
-extern int usevol[16];
+extern int play_ext, reverb, chorus, lookahead;
 extern int mt32pgm[128], MT32;
-extern struct miditrack seq[MAXTRKS];
-extern float skew;
-extern unsigned long int default_tempo;
-extern void load_sysex(int, unsigned char *, int);
+extern void load_sysex(struct synth *, int, unsigned char *, int);
 extern void showevent(int, unsigned char *, int);
 extern void init_show();
 extern int updatestatus();
 
 Uint32 ticks, tempo;
-Uint32 start_tick;
 struct timeval start_time;
-extern struct midi_packet *tseqh, *tseqt;
 
 unsigned long int rvl(struct miditrack *s)
 {
@@ -60,36 +55,98 @@ unsigned long int rvl(struct miditrack *s)
 /* indexed by high nibble of command */
 int cmdlen[16] = {0, 0, 0, 0, 0, 0, 0, 0, 2, 2, 2, 2, 1, 1, 2, 0};
 
-#define CHN		(seq[track].running_st & 0xf)
+#define CHN		(status & 0xf)
 #define NOTE		data[0]
 #define VEL		data[1]
 
-int playevents(void)
+/* set up the channels of syn the way every song starts */
+void start_channels(struct synth *syn)
 {
-    unsigned long int tempo = default_tempo, lasttime = 0;
+    int chn;
+
+    for (chn = 0; chn < 16; chn++) {
+	seq_control(syn, chn, CTL_BANK_SELECT, 0);
+	seq_control(syn, chn, CTL_REVERB_DEPTH, reverb);
+	seq_control(syn, chn, CTL_CHORUS_DEPTH, chorus);
+	seq_control(syn, chn, CTL_MAIN_VOLUME, 127);
+	seq_chn_pressure(syn, chn, 127);
+	//seq_control(syn, chn, CTL_BRIGHTNESS, 127);
+    }
+}
+
+/* send the event with status byte status and length bytes of data to syn */
+void play_event(struct synth *syn, int status, unsigned char *data,
+		int length)
+{
+    int i;
+
+    if (status < 0x80 || !SYNPLAYING(syn, CHN))
+	return;
+    /* data bytes are 7 bits, anything else is a broken file, not a note */
+    for (i = 0; status < 0xf0 && i < length; i++)
+	if (data[i] & 0x80)
+	    return;
+    switch (status & 0xf0) {
+    case MIDI_KEY_PRESSURE:
+	seq_key_pressure(syn, CHN, NOTE, VEL);
+	break;
+    case MIDI_NOTEON:
+	if (VEL && syn->usevol[CHN])
+	    VEL = syn->usevol[CHN];
+	seq_start_note(syn, CHN, NOTE, VEL);
+	break;
+    case MIDI_NOTEOFF:
+	seq_stop_note(syn, CHN, NOTE, VEL);
+	break;
+    case MIDI_CTL_CHANGE:
+	seq_control(syn, CHN, NOTE, VEL);
+	break;
+    case MIDI_CHN_PRESSURE:
+	seq_chn_pressure(syn, CHN, NOTE);
+	break;
+    case MIDI_PITCH_BEND:
+	seq_bender(syn, CHN, NOTE, VEL);
+	break;
+    case MIDI_PGM_CHANGE:
+	seq_set_patch(syn, CHN, NOTE);
+	break;
+    case MIDI_SYSTEM_PREFIX:
+	if (length > 1)
+	    load_sysex(syn, length, data, status);
+	break;
+    default:
+	break;
+    }
+}
+
+/* play song on synth syn, in real time unless it renders to a file */
+int playevents(struct synth *syn, struct midisong *song)
+{
+    unsigned long int tempo = song->tempo, lasttime = 0;
     unsigned int lowtime, track, best, length;
     unsigned char *data;
     double current = 0.0, dtime = 0.0;
     int play_status, playing = 1;
+    struct miditrack *seq = song->seq;
+    int ntrks = song->ntrks, division = song->division;
+    /* offline renders run side by side, leave display and midi clock alone */
+    int live = (syn->out == NULL);
 
-    init_show();
-    seq_reset(0);
-    ticks = 0;
-    start_tick = SDL_GetTicks();
-    gettimeofday(&start_time, NULL);
+    if (live)
+	init_show();
+    seq_reset(syn, 0);
+    if (live) {
+	ticks = 0;
+	gettimeofday(&start_time, NULL);
+    }
     for (track = 0; track < ntrks && seq[track].data; track++) {
 	seq[track].index = seq[track].running_st = 0;
 	seq[track].ticks = rvl(&seq[track]);
     }
-    for (best = 0; best < 16; best++) {
-	seq_control(best, CTL_BANK_SELECT, 0);
-	seq_control(best, CTL_REVERB_DEPTH, reverb);
-	seq_control(best, CTL_CHORUS_DEPTH, chorus);
-	seq_control(best, CTL_MAIN_VOLUME, 127);
-	seq_chn_pressure(best, 127);
-	//seq_control(best, CTL_BRIGHTNESS, 127);
-    }
+    start_channels(syn);
     while (playing) {
+	if (syn->out_failed)
+	    break;		/* the file or client output is gone */
 	lowtime = ~0;
 	for (best = track = 0; track < ntrks && seq[track].data; track++)
 	    if (seq[track].ticks < lowtime) {
@@ -119,61 +176,33 @@ int playevents(void)
 	    if (seq[track].ticks > lasttime) {
 		if (division > 0) {
 		    dtime = ((double) ((seq[track].ticks - lasttime) * (tempo / 1000)) /
-			     (double) (division)) * skew;
+			     (double) (division)) * syn->skew;
 		    current += dtime;
 		    lasttime = seq[track].ticks;
 		} else if (division < 0)
 		    current = ((double) seq[track].ticks /
 			       ((double) ((division & 0xff00 >> 8) *
-				   (division & 0xff)) * 1000.0)) * skew;
+				   (division & 0xff)) * 1000.0)) * syn->skew;
 		/* stop if there's more than 40 seconds of nothing */
 		if (dtime > 40096.0)
 		    playing = 0;
-		else if ((int) current > ticks) {
-                    Uint32 timeout = start_tick + current;
-                    while (0 && !SDL_TICKS_PASSED(SDL_GetTicks(), timeout)) {
-                      SDL_Delay(timeout - SDL_GetTicks());
-                    }
-                    ticks = current;
-		    if (graphics)
+		else if ((int) current > syn->ticks) {
+		    /* keep only lookahead ms of events queued past the output */
+		    while (seq_wait(syn, current, lookahead))
+			if (live && graphics)
+			    if ((play_status = updatestatus()) != NO_EXIT)
+				return play_status;
+		    syn->ticks = current;
+		    if (live)
+			ticks = syn->ticks;
+		    if (live && graphics)
 			if ((play_status = updatestatus()) != NO_EXIT)
 			    return play_status;
 		}
 	    }
-	    if (playing && seq[track].running_st > 0x7f && ISPLAYING(CHN)) {
-		switch (seq[track].running_st & 0xf0) {
-		case MIDI_KEY_PRESSURE:
-		    seq_key_pressure(CHN, NOTE, VEL);
-		    break;
-		case MIDI_NOTEON:
-		    if (VEL && usevol[CHN])
-			VEL = usevol[CHN];
-		    seq_start_note(CHN, NOTE, VEL);
-		    break;
-		case MIDI_NOTEOFF:
-		    seq_stop_note(CHN, NOTE, VEL);
-		    break;
-		case MIDI_CTL_CHANGE:
-		    seq_control(CHN, NOTE, VEL);
-		    break;
-		case MIDI_CHN_PRESSURE:
-		    seq_chn_pressure(CHN, NOTE);
-		    break;
-		case MIDI_PITCH_BEND:
-		    seq_bender(CHN, NOTE, VEL);
-		    break;
-		case MIDI_PGM_CHANGE:
-		    seq_set_patch(CHN, NOTE);
-		    break;
-		case MIDI_SYSTEM_PREFIX:
-		    if (length > 1)
-			load_sysex(length, data, seq[track].running_st);
-		    break;
-		default:
-		    break;
-		}
-            }
-	    if (verbose || graphics) {
+	    if (playing)
+		play_event(syn, seq[track].running_st, data, length);
+	    if (live && (verbose || graphics)) {
 		showevent(seq[track].running_st, data, length);
 	    }
 	}
@@ -184,5 +213,9 @@ int playevents(void)
 	else
 	    seq[track].ticks += rvl(&seq[track]);
     }
+    while (seq_wait(syn, syn->ticks, 0))	/* let the output reach the last event */
+	if (live && graphics)
+	    if ((play_status = updatestatus()) != NO_EXIT)
+		return play_status;
     return 1;
 }
@@ -24,27 +24,77 @@
 #include <sys/stat.h>
 #include "playmidi.h"
 
-struct miditrack seq[MAXTRKS];
+struct midisong song;		/* the file being played */
 
 int verbose = 0, chanmask = 0xffff, perc = 0x0200;
 int dochan = 1, play_ext = 0;
 int useprog[16], usevol[16];
 int graphics = 0, reverb = 0, chorus = 0;
 int find_header = 0, MT32 = 0;
-FILE *mfd;
+int cache_mb = 256, ctlrate = 32, lookahead = 100, renderahead = 0;
+int mixthreads = 1, renderthreads = 0, wavbits = 32;
+char *stem_prefix = NULL, *batch_dir = NULL, *server_path = NULL;
+char *stream_path = NULL, *wav_filename = NULL, *audio_out = "sdl";
+char *bank_filename = NULL;
 int ext_dev = 0;
-unsigned long int default_tempo;
 char *filename;
 char *sf2_filename = "inst.sf2";
 float skew = 1.0;
-extern int ntrks;
+struct synth *synth;		/* soft synth engine the songs are played on */
 extern int mt32pgm[128];
-extern int playevents();
+extern int playevents(struct synth *, struct midisong *);
 extern int gus_load(int);
-extern int readmidi(unsigned char *, off_t);
+extern int readmidi(struct midisong *, unsigned char *, off_t);
+extern unsigned char *load_midi(char *, off_t *);
+extern int batch_render(char *, int, char **);
+extern int serve(char *);
+extern int stream_render(char *);
 extern void loadfm();
 extern void setup_show(int, char **);
 extern void close_show(int);
+extern struct synth *synth_new(char *);
+extern void synth_free(struct synth *);
+extern int synth_open_wav(struct synth *, char *);
+extern void synth_close_out(struct synth *);
+
+static void free_synth(void)
+{
+    synth_free(synth);
+}
+
+/* parse "[chan,]x[,chan,x...]" into vals[16], x for every channel if */
+/* no chan is given.  returns NULL, or else what is wrong with arg */
+char *parse_chanvals(char *arg, int *vals)
+{
+    char *extra;
+    int j, val;
+
+    if (strchr(arg, ',') == NULL) {	/* set all channels */
+	val = atoi(arg);
+	if (val < 1 || val > 128)
+	    return "must be 1 - 128";
+	for (j = 0; j < 16; j++)
+	    vals[j] = val;
+	return NULL;
+    }
+    extra = arg;		/* set channels individually */
+    while (extra != NULL) {
+	j = atoi(extra);
+	if (j < 1 || j > 16)
+	    return "chan must be 1 - 16";
+	extra = strchr(extra, ',');
+	if (extra == NULL)
+	    return "needs a value after each chan";
+	val = atoi(++extra);
+	if (val < 1 || val > 128)
+	    return "must be 1 - 128";
+	vals[j - 1] = val;
+	extra = strchr(extra, ',');
+	if (extra != NULL)
+	    extra++;
+    }
+    return NULL;
+}
 
 int main(argc, argv)
 int argc;
@@ -54,17 +104,20 @@ char **argv;
     extern int optind;
     int i, error = 0, j, newprog;
     char *extra;
-    char *filebuf;
+    unsigned char *filebuf;
     struct stat info;
-    int piped = 0;
+    off_t filesize;
+    Uint64 t0;
+    double secs, wall;
 
-    printf("%s Copyright 2015 Nathan I. Laredo\n"
-	   "This is free software with ABSOLUTELY NO WARRANTY.\n"
-	   "For details please see the file COPYING.\n", RELEASE);
+    /* on stderr, stdout may be carrying audio */
+    fprintf(stderr, "%s Copyright 2015 Nathan I. Laredo\n"
+	    "This is free software with ABSOLUTELY NO WARRANTY.\n"
+	    "For details please see the file COPYING.\n", RELEASE);
     for (i = 0; i < 16; i++)
 	useprog[i] = usevol[i] = 0;	/* reset options */
     while ((i = getopt(argc, argv,
-		     "c:aA:b:C:dD:eE:F:gh:G:i:lMp:P:rR:t:vV:x:z")) != -1)
+		     "c:aA:b:B:C:dD:eE:f:F:gh:G:i:j:k:K:lL:m:Mn:o:O:p:P:rR:S:t:U:vV:w:W:x:z")) != -1)
 	switch (i) {
         case 'b':
             sf2_filename = strdup(optarg);
@@ -104,44 +157,84 @@ char **argv;
 	    MT32++;
 	    break;
 	case 'p':
-	    if (strchr(optarg, ',') == NULL) {	/* set all channels */
-		newprog = atoi(optarg);
-		if (newprog < 1 || newprog > 128) {
-		    fprintf(stderr, "option -p prog must be 1 - 128\n");
-		    exit(1);
-		}
-		for (j = 0; j < 16; j++)
-		    useprog[j] = newprog;
-	    } else {		/* set channels individually */
-		extra = optarg;
-		while (extra != NULL) {
-		    j = atoi(extra);
-		    if (j < 1 || j > 16) {
-			fprintf(stderr, "opton -p chan must be 1 - 16\n");
-			exit(1);
-		    }
-		    extra = strchr(extra, ',');
-		    if (extra == NULL) {
-			fprintf(stderr, "option -p prog needed for chan %d\n",
-				j);
-			exit(1);
-		    } else
-			extra++;
-		    newprog = atoi(extra);
-		    if (newprog < 1 || newprog > 128) {
-			fprintf(stderr, "option -p prog must be 1 - 128\n");
-			exit(1);
-		    }
-		    useprog[j - 1] = newprog;
-		    extra = strchr(extra, ',');
-		    if (extra != NULL)
-			extra++;
-		}
+	    if ((extra = parse_chanvals(optarg, useprog)) != NULL) {
+		fprintf(stderr, "option -p prog %s\n", extra);
+		exit(1);
+	    }
+	    break;
+	case 'j':
+	    mixthreads = atoi(optarg);
+	    if (mixthreads < 1 || mixthreads > 16) {
+		fprintf(stderr, "option -j threads must be 1 - 16\n");
+		exit(1);
+	    }
+	    break;
+	case 'n':
+	    renderthreads = atoi(optarg);
+	    if (renderthreads < 1 || renderthreads > 256) {
+		fprintf(stderr, "option -n threads must be 1 - 256\n");
+		exit(1);
+	    }
+	    break;
+	case 'k':
+	    ctlrate = atoi(optarg);
+	    if (ctlrate < 1 || ctlrate > 256) {
+		fprintf(stderr, "option -k rate must be 1 - 256\n");
+		exit(1);
+	    }
+	    break;
+	case 'B':
+	    renderahead = atoi(optarg);
+	    if (renderahead < 0 || renderahead > 64) {
+		fprintf(stderr, "option -B blocks must be 0 - 64\n");
+		exit(1);
+	    }
+	    break;
+	case 'L':
+	    lookahead = atoi(optarg);
+	    if (lookahead < 10 || lookahead > 2000) {
+		fprintf(stderr, "option -L lookahead must be 10 - 2000 ms\n");
+		exit(1);
+	    }
+	    break;
+	case 'm':
+	    cache_mb = atoi(optarg);
+	    if (cache_mb < 0 || cache_mb > 4095) {
+		fprintf(stderr, "option -m cache must be 0 - 4095 MB\n");
+		exit(1);
 	    }
 	    break;
 	case 'r':
 	    graphics++;
 	    break;
+	case 'S':
+	    stem_prefix = optarg;
+	    break;
+	case 'o':
+	    wav_filename = optarg;
+	    break;
+	case 'O':
+	    audio_out = optarg;
+	    break;
+	case 'K':
+	    bank_filename = optarg;
+	    break;
+	case 'W':
+	    wavbits = atoi(optarg);
+	    if (wavbits != 16 && wavbits != 24 && wavbits != 32) {
+		fprintf(stderr, "option -W bits must be 16, 24 or 32\n");
+		exit(1);
+	    }
+	    break;
+	case 'w':
+	    batch_dir = optarg;
+	    break;
+	case 'U':
+	    server_path = optarg;
+	    break;
+	case 'f':
+	    stream_path = optarg;
+	    break;
 	case 't':
 	    if ((skew = atof(optarg)) < .25) {
 		fprintf(stderr, "option -t skew under 0.25 unplayable\n");
@@ -190,39 +283,9 @@ char **argv;
 	    verbose++;
 	    break;
 	case 'V':
-	    if (strchr(optarg, ',') == NULL) {	/* set all channels */
-		newprog = atoi(optarg);
-		if (newprog < 1 || newprog > 128) {
-		    fprintf(stderr, "option -V vol must be 1 - 128\n");
-		    exit(1);
-		}
-		for (j = 0; j < 16; j++)
-		    usevol[j] = newprog;
-	    } else {		/* set channels individually */
-		extra = optarg;
-		while (extra != NULL) {
-		    j = atoi(extra);
-		    if (j < 1 || j > 16) {
-			fprintf(stderr, "opton -V chan must be 1 - 16\n");
-			exit(1);
-		    }
-		    extra = strchr(extra, ',');
-		    if (extra == NULL) {
-			fprintf(stderr, "option -V vol needed for chan %d\n",
-				j);
-			exit(1);
-		    } else
-			extra++;
-		    newprog = atoi(extra);
-		    if (newprog < 1 || newprog > 128) {
-			fprintf(stderr, "option -p prog must be 1 - 128\n");
-			exit(1);
-		    }
-		    usevol[j - 1] = newprog;
-		    extra = strchr(extra, ',');
-		    if (extra != NULL)
-			extra++;
-		}
+	    if ((extra = parse_chanvals(optarg, usevol)) != NULL) {
+		fprintf(stderr, "option -V vol %s\n", extra);
+		exit(1);
 	    }
 	    break;
 	case 'z':
@@ -236,10 +299,25 @@ char **argv;
 	    break;
 	}
 
-    if (error || optind >= argc) {
+    if (error || (optind >= argc && !server_path && !stream_path &&
+		  !bank_filename)) {
 	fprintf(stderr, "usage: %s [-options] file1 [file2 ...]\n", argv[0]);
 	fprintf(stderr, "  -v       verbosity (additive)\n"
 		"  -b sf2fn use sf2fn as filename for sf2 file to use\n"
+		"  -K bank  compile the -b sf2 file into bank, load that with -b\n"
+		"  -m x     cap float sample cache at x MB (0 disables)\n"
+		"  -k x     update envelopes and pitch every x samples\n"
+		"  -L x     queue events at most x ms ahead of the output\n"
+		"  -B x     render x blocks ahead in a worker thread\n"
+		"  -j x     mix voices on x threads\n"
+		"  -S pre   also write each channel to pre01.wav - pre16.wav\n"
+		"  -O out   play to out: sdl, null (no sound) or null-fast\n"
+		"  -o file  render the files into wav file file\n"
+		"  -W x     write wav files with x bit samples (16, 24, 32)\n"
+		"  -w dir   render files, or dirs of them, to dir/*.wav\n"
+		"  -U sock  serve render requests on unix socket sock\n"
+		"  -n x     render x files at once with -w or -U (default cores)\n"
+		"  -f fifo  render timed midi from fifo (- is stdin) to stdout\n"
 		"  -l       list available midi ports for -D x option\n"
 		"  -i x     ignore channels set in bitmask x (hex)\n"
 		"  -c x     play only channels set in bitmask x (hex)\n"
@@ -261,52 +339,60 @@ char **argv;
 		"  -r       real-time playback graphics\n");
 	exit(1);
     }
+    if (bank_filename)
+	exit(save_bank(sf2_filename, bank_filename) < 0);
+    if (wav_filename && (graphics || play_ext)) {
+	fprintf(stderr, "options -r -e -E don't mix with -o\n");
+	exit(1);
+    }
+    if (batch_dir || server_path || stream_path) {
+	if (graphics || play_ext || stem_prefix || find_header ||
+	    wav_filename || !!batch_dir + !!server_path + !!stream_path > 1) {
+	    fprintf(stderr, "options -r -e -E -S -h -o -w -U -f don't mix\n");
+	    exit(1);
+	}
+	if (server_path)
+	    exit(serve(server_path));
+	if (stream_path)
+	    exit(stream_render(stream_path));
+	exit(batch_render(batch_dir, argc - optind, &argv[optind]));
+    }
+    /* stems are written as they render, which mustn't block the sound
+       card's callback.  the null outputs have no sound card to keep up */
+    if (stem_prefix && !wav_filename && strcmp(audio_out, "null") &&
+	strcmp(audio_out, "null-fast") && !renderahead) {
+	fprintf(stderr, "option -S needs -o, -O null, -O null-fast or -B\n");
+	exit(1);
+    }
+    /* the soundfont is only needed if something plays on the soft synth */
+    if ((synth = synth_new(play_ext != chanmask ? sf2_filename : NULL)) == NULL)
+	exit(1);
+    atexit(free_synth);
+    if (wav_filename && synth_open_wav(synth, wav_filename) < 0) {
+	perror(wav_filename);
+	exit(1);
+    }
+    t0 = SDL_GetPerformanceCounter();
     setup_show(argc, argv);
     /* play all filenames listed on command line */
     for (i = optind; i < argc;) {
 	filename = argv[i];
+	extra = NULL;
 	if (stat(filename, &info) == -1) {
-	    if ((extra = malloc(strlen(filename) + 4)) == NULL)
+	    if ((extra = malloc(strlen(filename) + 5)) == NULL)
 		close_show(-1);
 	    sprintf(extra, "%s.mid", filename);
-	    if (stat(extra, &info) == -1)
-		close_show(-1);
-	    if ((mfd = fopen(extra, "r")) == NULL)
-		close_show(-1);
-	    free(extra);
-	} else {
-	    char *ext = strrchr(filename, '.');
-	    if (ext && strcmp(ext, ".gz") == 0) {
-		char temp[1024];
-		piped = 1;
-		sprintf(temp, "gzip -l %s", filename);
-		if ((mfd = popen(temp, "r")) == NULL)
-		    close_show(-1);
-		fgets(temp, sizeof(temp), mfd); /* skip 1st line */
-		fgets(temp, sizeof(temp), mfd);
-		strtok(temp, " "); /* compressed size */
-		info.st_size = atoi(strtok(NULL, " ")); /* original size */
-		pclose(mfd);
-		sprintf(temp, "gzip -d -c %s", filename);
-		if ((mfd = popen(temp, "r")) == NULL)
-		    close_show(-1);
-	    } else if ((mfd = fopen(filename, "r")) == NULL)
-		close_show(-1);
 	}
-	if ((filebuf = malloc(info.st_size)) == NULL)
+	/* .gz files are inflated as they are read */
+	if ((filebuf = load_midi(extra ? extra : filename, &filesize)) == NULL)
 	    close_show(-1);
-	fread(filebuf, 1, info.st_size, mfd);
-	if (piped)
-	    pclose(mfd);
-	else
-	    fclose(mfd);
+	free(extra);
 	do {
-	    default_tempo = 500000;
 	    /* error holds number of tracks read */
-	    error = readmidi((unsigned char *)filebuf, info.st_size);
+	    error = readmidi(&song, filebuf, filesize);
 	    newprog = 1;	/* if there's an error skip to next file */
 	    if (error > 0)	/* error holds number of tracks read */
-		while ((newprog = playevents()) == 0);
+		while ((newprog = playevents(synth, &song)) == 0);
 	    if (find_header)	/* play headers following selected */
 		find_header += newprog;
 	} while (find_header);
@@ -314,6 +400,20 @@ char **argv;
 	    i = optind;		/* can't skip back past first file */
 	free(filebuf);
     }
+    if (synth->out) {		/* -o, or -O null-fast */
+	synth_close_out(synth);
+	if (synth->out_failed) {
+	    fprintf(stderr, "%s: write failed\n",
+		    wav_filename ? wav_filename : audio_out);
+	    close_show(1);
+	}
+	secs = synth->samplepos / synth->rate;	/* all the songs */
+	wall = (double) (SDL_GetPerformanceCounter() - t0) /
+	    SDL_GetPerformanceFrequency();
+	printf("%s: %.1f s in %.2f s, rtf %.4f, peak polyphony %d\n",
+	       wav_filename ? wav_filename : audio_out, secs, wall,
+	       secs > 0 ? wall / secs : 0.0, synth->poly_peak);
+    }
     close_midi();
     close_show(0);
     exit(0);			/* this statement is here to keep the compiler happy */
@@ -8,6 +8,8 @@
 
 #define RELEASE "Playmidi 2.9"
 
+#include <stdatomic.h>
+
 #include "SDL2/SDL.h"
 #include "SDL2/SDL_audio.h"
 
@@ -172,6 +174,8 @@ enum midi_system_messages {
 #define ISPERC(x)	(perc & (1 << (x)))
 #define ISMIDI(x)	(play_ext & (1 << (x)))
 #define ISPLAYING(x)	(chanmask & (1 << (x)))
+#define SYNPERC(s, x)	((s)->perc & (1 << (x)))  /* percussion in synth s */
+#define SYNPLAYING(s, x)	((s)->chanmask & (1 << (x)))  /* played by s */
 #define NO_EXIT		100
 
 struct lfostate {
@@ -184,6 +188,7 @@ struct chanstate {
   float bender_mult;    // value to multiply per tone 'r' by for pitchbend
   float mod_mult;       // value to multiply lfo per tone 'r' by for modwheel
   int program;          // midi program to play for this channel, < 0 = use math
+  int phdr;             // sf2 preset for program and bank, see chan_preset()
   int bender;           // midi pitch bend value in effect, default = 8192
   int bender_range;     // pitchbend range in cents, default = 200
   int controller[256];  // up to 14-bit midi controller data values, see CTL_*
@@ -206,6 +211,7 @@ struct voice_env {
 
 };
 
+/* voice setup record, filled at note-on then copied into a voice pool slot */
 struct voicestate {
   float f;              // frequency for this voice
   float r;              // value to add to timebase each sample
@@ -224,14 +230,45 @@ struct voicestate {
 
   // sf2 access tracking, used at note-on time only to initialize voice
   int phdr;             // index into phdr chunk
-  int pbag, pbag_max;   // current and last index into pbag chunk
-  int pgen, pgen_max;   // current and last index into pgen chunk
-  int pmod, pmod_max;   // current and last index into pmod chunk (unused)
-  int inst;             // current index into inst chunk
-  int ibag, ibag_max;   // current and last index into ibag chunk
-  int igen, igen_max;   // current and last index into igen chunk
-  int imod, imod_max;   // current and last index into imod chunk (unused)
   int shdr;             // current index into shdr chunk
+  struct sfCache *cache;  // float copy of the sample, filled, or NULL
+};
+
+/* raise at build time for more polyphony, unused slots cost no cpu time */
+#ifndef POLYMAX
+#define POLYMAX 128
+#endif
+
+/* voice pool: per-voice state in parallel arrays indexed by voice slot, */
+/* so the render loop only touches the fields it uses for sounding voices */
+struct voicepool {
+  float t[POLYMAX];     // timebase for each voice, math 0 - 2pi, or sample pos
+  float r[POLYMAX];     // value to add to timebase each sample
+  float v[POLYMAX];     // velocity 0.0 - 1.0
+  float pan[POLYMAX];   // pan, 0.0(l) - 1.0(r), 0.5 = center
+  int channel[POLYMAX]; // midi channel for each voice 0-15
+  int shdr[POLYMAX];    // sf2 sample header index, < 0 = math synthesis
+  Uint64 timestamp[POLYMAX];      // event start sample position
+  Uint64 endstamp[POLYMAX];       // sample position at note off plus release
+  struct voice_env env[POLYMAX];  // volume envelope, in sample units
+  struct sf2gen s[POLYMAX];       // sf2 sample data
+  struct sfCache *cache[POLYMAX]; // float copy of sample data, or NULL
+  // note-on, note-off and controller lookups only
+  int note[POLYMAX];    // midi note number being played
+  int sustain[POLYMAX]; // if note off is deferred by CTL_SUSTAIN, sustain=1
+  int exclusive_class[POLYMAX];  // if > 0, new notes stop same ch+class
+  // lists of active slots linked through next/prev, head < 0 when empty
+  int keyhead[16][128];  // every active voice, by channel and note
+  int keynext[POLYMAX], keyprev[POLYMAX];
+  int sushead[16];       // voices held by CTL_SUSTAIN, by channel
+  int susnext[POLYMAX], susprev[POLYMAX];
+  int xhead[16];         // voices with an exclusive class, by channel
+  int xnext[POLYMAX], xprev[POLYMAX];
+  // slot bookkeeping, every slot is either active or idle
+  int active[POLYMAX];  // slots of sounding voices, in start order
+  int nactive;          // number of entries in active[]
+  int idle[POLYMAX];    // stack of slots free for new voices
+  int nidle;            // number of entries in idle[]
 };
 
 struct midi_packet {
@@ -240,6 +277,83 @@ struct midi_packet {
   Uint8 data[0];        // data for event
 };
 
+#define SAMPLELEN 512               // samples rendered per span or block
+#define PACKET_LIST_BYTES 262144    // space for queued midi events
+#define MIXLANES 16                 // voices are mixed in fixed lanes
+
+/* one of the threads that mix the lanes of a synth, see mix_worker() */
+struct mixthread {
+  struct synth *syn;    // synth whose spans this thread mixes
+  int t;                // thread number, mixes lanes t, t + mixthreads, ...
+  SDL_sem *go;          // posted to start mixing each span
+  SDL_Thread *thread;   // the thread itself
+};
+
+/* soft synth engine instance, everything one song plays with, so any */
+/* number of them can render side by side.  see synth_new() in emumidi.c */
+struct synth {
+  struct sfSFBK *sf2;   // shared read-only soundfont, NULL for math only
+  float rate;           // output sample rate
+  int perc;             // channels played as percussion, see SYNPERC()
+  int chanmask;         // channels of the song played, see SYNPLAYING()
+  int useprog[16];      // program forced on each channel + 1, or 0
+  int usevol[16];       // note on velocity forced on each channel, or 0
+  float skew;           // tempo skew, 1.0 plays the song as written
+  int ctlrate;          // samples between envelope and pitch updates
+  Uint32 ticks;         // song time in ms of the events being queued
+  /*
+   * single producer, single consumer queue: the seq_* calls fill in the
+   * packet at tseqh and publish it with a release store of the next
+   * position, the renderer hands consumed space back the same way
+   * through tseqt.
+   */
+  Uint8 pdata[PACKET_LIST_BYTES];       // space for queued midi events
+  _Atomic(struct midi_packet *) tseqh;  // enqueue pos
+  _Atomic(struct midi_packet *) tseqt;  // dequeue pos
+  atomic_uint pkts_in, pkts_out;  // packets queued and played so far
+  unsigned int pkts_peak;         // most packets ever waiting in the queue
+  struct voicepool pool;          // all voices, see active list for playing
+  int poly_peak;                  // most voices ever playing at once
+  struct chanstate channel[16];   // presently active channel state
+  struct chanstate seqchan[16];   // channel state at end of the queue
+  float atune;                    // affects all midi note conversions
+  float scaletune[16][12];        // 16 channels of tuning adjust
+  float tlfo;                     // shared triangle lfo timebase, 0 - 2pi
+  float rlfo;                     // value to add to lfo timebase each sample
+  float max_val;                  // loudest sample so far, see render_audio()
+  float normalize;                // gain in effect at the end of the output
+  Uint64 samplepos;               // current position in the sample output
+  _Atomic Uint64 playpos;         // samplepos as of the last audio callback
+  Uint64 songpos;                 // sample position where the song started
+  Uint32 songtick;                // SDL_GetTicks() when the song started
+  const struct audio_backend *backend;  // soft synth output, or NULL
+  SDL_AudioDeviceID sdl_dev;      // sdl output device, 0 if not opened
+  SDL_Thread *null_thread;        // null output, pulling blocks in time
+  SDL_mutex *null_lock;           // held by it while it renders
+  SDL_RWops *out;                 // file or stream rendered to, or NULL
+  int out_wav;                    // nonzero if out has a wav header
+  int out_failed;                 // a write to out failed, render no more
+  int wav_bits;                   // wav samples: 16 or 24 bit, 32 is float
+  int quit;                       // tells the worker threads to exit
+  /* voice mixing, see mix_lanes() */
+  int mixthreads;                       // threads mixing each span
+  float mix_buf[MIXLANES][SAMPLELEN * 2];  // lanes 1 and up, stereo
+  float *mix_out, *mix_lfo;       // span being mixed, lane 0 goes to out
+  int mix_n;                      // samples in that span
+  struct mixthread mix[MIXLANES]; // threads 1 and up, 0 is the caller
+  SDL_sem *mix_done;              // posted by each thread when it's done
+  int stems;                      // nonzero to mix a lane per channel
+  SDL_RWops *stem[16];            // wav file for each channel lane, or NULL
+  /* render ahead ring, see ahead_render() */
+  int renderahead;                // blocks in the ring, 0 if off
+  SDL_Thread *ahead_thread;       // worker rendering blocks, NULL if off
+  SDL_mutex *ahead_lock;          // held by the worker while it renders
+  SDL_sem *ahead_free;            // counts blocks free for the worker to fill
+  float *ahead_pcm;               // renderahead blocks of SAMPLELEN samples
+  atomic_uint ahead_head, ahead_tail;  // blocks rendered and played
+  int ahead_off;                  // samples copied out of the tail block
+};
+
 /* Non-standard MIDI file formats */
 #define RIFF   0x52494646
 #define CTMF   0x43544d46
@@ -276,6 +390,13 @@ struct miditrack {
    Uint8 running_st; /* running status byte */
 };
 
+/* a midi file in memory, split into its tracks by readmidi() */
+struct midisong {
+   struct miditrack seq[MAXTRKS];
+   int format, ntrks, division;
+   unsigned long int tempo; /* initial usec per quarter note */
+};
+
 /* hardware specific midi access abstracted by the following */
 extern void init_midi(void);
 extern void close_midi(void);
@@ -16,40 +16,45 @@
  *************************************************************************/
 #include "playmidi.h"
 #include "SDL2/SDL.h"
+#include <limits.h>
+#include <sys/stat.h>
+#include <zlib.h>
 
-int format, ntrks, division;
-unsigned char *midifilebuf;
+#define LOAD_PAD	32	/* zeroes after the data loaded, readmidi
+				   takes the header before the length */
 
-extern struct miditrack seq[MAXTRKS];
 extern int find_header;
-extern unsigned long int default_tempo;
 
-unsigned short Read16()
+static unsigned short Read16(unsigned char **buf)
 {
     register unsigned short x;
 
-    x = (*(midifilebuf) << 8) | midifilebuf[1];
-    midifilebuf += 2;
+    x = (**buf << 8) | (*buf)[1];
+    *buf += 2;
     return x;
 }
 
-unsigned long Read32()
+static unsigned long Read32(unsigned char **buf)
 {
     register unsigned long x;
 
-    x = (*(midifilebuf) << 24) | (midifilebuf[1] << 16) |
-	(midifilebuf[2] << 8) | midifilebuf[3];
-    midifilebuf += 4;
+    x = ((unsigned long)**buf << 24) | ((*buf)[1] << 16) |
+	((*buf)[2] << 8) | (*buf)[3];
+    *buf += 4;
     return x;
 }
 
-int readmidi(filebuf, filelength)
+/* split the midi file in filebuf into the tracks of song */
+int readmidi(song, filebuf, filelength)
+struct midisong *song;
 unsigned char *filebuf;
 off_t filelength;
 {
     unsigned long int i = 0, track, tracklen;
+    unsigned char *midifilebuf = filebuf;
+    struct miditrack *seq = song->seq;
 
-    midifilebuf = filebuf;
+    song->tempo = 500000;	/* 120 bpm until the file sets a tempo */
     /* allow user to specify header number in from large archive */
     while (i != find_header && midifilebuf < (filebuf + filelength - 32)) {
 	if (strncmp((char *)midifilebuf, "MThd", 4) == 0) {
@@ -64,28 +69,28 @@ off_t filelength;
     }
     if (midifilebuf != filebuf)
 	midifilebuf -= 4;
-    i = Read32();
+    i = Read32(&midifilebuf);
     if (i == RIFF) {
 	midifilebuf += 16;
-	i = Read32();
+	i = Read32(&midifilebuf);
     }
     if (i == MThd) {
-	tracklen = Read32();
-	format = Read16();
-	ntrks = Read16();
-	division = Read16();
+	tracklen = Read32(&midifilebuf);
+	song->format = Read16(&midifilebuf);
+	song->ntrks = Read16(&midifilebuf);
+	song->division = Read16(&midifilebuf);
     } else if (i == CTMF) {
 	/* load a creative labs CMF file, with instruments for fm */
 	tracklen = midifilebuf[4] | (midifilebuf[5] << 8);
-	format = 0;
-	ntrks = 1;
-	division = midifilebuf[6] | (midifilebuf[7] << 8);
-	default_tempo = 1000000 * division /
+	song->format = 0;
+	song->ntrks = 1;
+	song->division = midifilebuf[6] | (midifilebuf[7] << 8);
+	song->tempo = 1000000 * song->division /
 		(midifilebuf[8] | (midifilebuf[9] << 8));
 	seq[0].data = filebuf + tracklen;
 	seq[0].length = filelength - tracklen;
 	i = (unsigned long int) (*(short *) &midifilebuf[2]) - 4;
-	return ntrks;
+	return song->ntrks;
     } else {
 	int found = 0;
 	while (!found && midifilebuf < (filebuf + filelength - 8))
@@ -95,28 +100,29 @@ off_t filelength;
 		midifilebuf++;
 	if (found) {
 	    midifilebuf += 4;
-	    tracklen = Read32();
-	    format = Read16();
-	    ntrks = Read16();
-	    division = Read16();
+	    tracklen = Read32(&midifilebuf);
+	    song->format = Read16(&midifilebuf);
+	    song->ntrks = Read16(&midifilebuf);
+	    song->division = Read16(&midifilebuf);
 	} else {
 #ifndef DISABLE_RAW_MIDI_FILES
 	    /* this allows playing ANY file, so watch out */
 	    midifilebuf -= 4;
-	    format = 0;		/* assume it's .mus file ? */
-	    ntrks = 1;
-	    division = 40;
+	    song->format = 0;		/* assume it's .mus file ? */
+	    song->ntrks = 1;
+	    song->division = 40;
 #else
 	    return -1;
 #endif
 	}
     }
-    if (ntrks > MAXTRKS) {
-	fprintf(stderr, "\nWARNING: %d TRACKS IGNORED!\n", ntrks - MAXTRKS);
-	ntrks = MAXTRKS;
+    if (song->ntrks > MAXTRKS) {
+	fprintf(stderr, "\nWARNING: %d TRACKS IGNORED!\n",
+		song->ntrks - MAXTRKS);
+	song->ntrks = MAXTRKS;
     }
-    for (track = 0; track < ntrks; track++) {
-	if (Read32() != MTrk) {
+    for (track = 0; track < song->ntrks; track++) {
+	if (Read32(&midifilebuf) != MTrk) {
 	    /* MTrk isn't where it's supposed to be, search rest of file */
 	    int fuzz, found = 0;
 	    midifilebuf -= 4;
@@ -139,13 +145,63 @@ off_t filelength;
 		    continue;
 	    }
 	}
-	tracklen = Read32();
+	tracklen = Read32(&midifilebuf);
 	if (midifilebuf + tracklen > filebuf + filelength)
 	    tracklen = filebuf + filelength - midifilebuf;
 	seq[track].length = tracklen;
 	seq[track].data = midifilebuf;
 	midifilebuf += tracklen;
     }
-    ntrks = track;
-    return ntrks;
+    song->ntrks = track;
+    return song->ntrks;
+}
+
+/* read all of midi file filename into a new buffer, inflating it on the
+   way in when it is gzip compressed, so archives need no gzip program.
+   returns the buffer, zero padded past its length in *size, or NULL
+   after saying why the file can't be read */
+unsigned char *load_midi(char *filename, off_t *size)
+{
+    unsigned char *buf = NULL, *grown;
+    struct stat info;
+    size_t len = 0, room;
+    gzFile gz;
+    int n = 0, err;
+
+    if (stat(filename, &info) == -1 ||
+	(gz = gzopen(filename, "rb")) == NULL) {
+	perror(filename);
+	return NULL;
+    }
+    gzbuffer(gz, 128 << 10);
+    /* a byte more than a plain file needs, so it is read whole without
+       growing, while compressed ones double until they fit */
+    room = info.st_size + 1;
+    do {
+	if (buf == NULL || len == room) {
+	    if (buf != NULL)
+		room *= 2;
+	    if ((grown = realloc(buf, room + LOAD_PAD)) == NULL) {
+		perror(filename);
+		free(buf);
+		gzclose(gz);
+		return NULL;
+	    }
+	    buf = grown;
+	}
+	n = gzread(gz, buf + len, SDL_min(room - len, INT_MAX));
+	if (n > 0)
+	    len += n;
+    } while (n > 0);
+    if (n < 0)
+	fprintf(stderr, "%s: %s\n", filename, gzerror(gz, &err));
+    if ((err = gzclose(gz)) == Z_BUF_ERROR)
+	fprintf(stderr, "%s: compressed data cut short\n", filename);
+    if (n < 0 || err != Z_OK) {
+	free(buf);
+	return NULL;
+    }
+    memset(buf + len, 0, LOAD_PAD);
+    *size = len;
+    return buf;
 }
@@ -0,0 +1,265 @@
+/************************************************************************
+   server.c  -- render midi files sent over a unix domain socket
+
+   Copyright 2015 Nathan Laredo (laredo@gnu.org)
+
+   This program is modifiable/redistributable under the terms
+   of the GNU General Public Licence.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+   One request per connection: a line of space separated key=value
+   options, then size bytes of midi file.  The reply is a line, either
+   "OK wav <rate>" or "OK pcm <rate>" followed by the rendered audio
+   until the connection closes, or "ERR <reason>".  pcm is interleaved
+   stereo 32 bit float in host byte order.  Options are
+
+	size=<bytes>		length of the midi file that follows
+	format=wav|pcm		what to send back, wav if not given
+	rate=<hz>		output sample rate, 8000 - 192000
+	chanmask=<hex>		channels to play, like -c
+	prog=[chan,]prog...	program overrides, like -p
+	vol=[chan,]vol...	note on velocity overrides, like -V
+	skew=<float>		tempo skew, like -t
+
+   A client that sends nothing, or reads none of the audio, for
+   REQ_TIMEOUT seconds is hung up on, and a song whose client has gone
+   is not rendered any further.
+ *************************************************************************/
+#include "playmidi.h"
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#define REQ_MAXLINE	1024		/* longest request line */
+#define REQ_MAXSIZE	(64 << 20)	/* biggest midi file taken */
+#define REQ_TIMEOUT	10		/* seconds a client may stall us */
+
+extern int renderthreads, verbose;
+extern char *sf2_filename;
+extern int readmidi(struct midisong *, unsigned char *, off_t);
+extern int playevents(struct synth *, struct midisong *);
+extern char *parse_chanvals(char *, int *);
+extern struct synth *synth_new(char *);
+extern void synth_free(struct synth *);
+extern void synth_restart(struct synth *);
+extern int synth_open_rw(struct synth *, SDL_RWops *, int);
+extern void synth_close_out(struct synth *);
+
+static int listen_fd;
+
+/* apply the options in request line req to syn, returns NULL when they */
+/* are all fine, or else writes what is wrong to err and returns it */
+static char *parse_request(struct synth *syn, char *req, size_t *size,
+			   int *wav, char *err, size_t len)
+{
+    char *word, *val, *bad, *save;
+    int rate;
+
+    *size = 0;
+    *wav = 1;
+    for (word = strtok_r(req, " \t\r\n", &save); word != NULL;
+	 word = strtok_r(NULL, " \t\r\n", &save)) {
+	bad = NULL;
+	if ((val = strchr(word, '=')) == NULL) {
+	    snprintf(err, len, "%s: not key=value", word);
+	    return err;
+	}
+	*val++ = '\0';
+	if (strcmp(word, "size") == 0) {
+	    *size = strtoul(val, NULL, 10);
+	    if (*size < 1 || *size > REQ_MAXSIZE)
+		bad = "must be 1 - 67108864";
+	} else if (strcmp(word, "format") == 0) {
+	    if (strcmp(val, "wav") == 0 || strcmp(val, "pcm") == 0)
+		*wav = (val[0] == 'w');
+	    else
+		bad = "must be wav or pcm";
+	} else if (strcmp(word, "rate") == 0) {
+	    rate = atoi(val);
+	    if (rate < 8000 || rate > 192000)
+		bad = "must be 8000 - 192000";
+	    else
+		syn->rate = rate;
+	} else if (strcmp(word, "chanmask") == 0)
+	    syn->chanmask = strtoul(val, NULL, 16);
+	else if (strcmp(word, "prog") == 0)
+	    bad = parse_chanvals(val, syn->useprog);
+	else if (strcmp(word, "vol") == 0)
+	    bad = parse_chanvals(val, syn->usevol);
+	else if (strcmp(word, "skew") == 0) {
+	    if ((syn->skew = atof(val)) < .25)
+		bad = "under 0.25 unplayable";
+	} else
+	    bad = "unknown option";
+	if (bad) {
+	    snprintf(err, len, "%s %s", word, bad);
+	    return err;
+	}
+    }
+    if (*size == 0) {
+	snprintf(err, len, "size missing");
+	return err;
+    }
+    return NULL;
+}
+
+/* answer one request on connection fd, rendering on syn */
+static void serve_client(struct synth *syn, struct midisong *song, int fd)
+{
+    char line[REQ_MAXLINE], err[REQ_MAXLINE];
+    unsigned char *buf = NULL;
+    Uint64 t0;
+    FILE *in, *out;
+    size_t size, n;
+    double secs, wall;
+    struct timeval timeout = { REQ_TIMEOUT, 0 };
+    int wav, dupfd;
+
+    /* a client that stops sending or reading mustn't hold the thread */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if ((dupfd = dup(fd)) == -1 || (in = fdopen(fd, "r")) == NULL ||
+	(out = fdopen(dupfd, "w")) == NULL) {
+	perror("fdopen");
+	close(fd);
+	if (dupfd != -1)
+	    close(dupfd);
+	return;
+    }
+    synth_restart(syn);		/* start from the server's own options */
+    if (fgets(line, sizeof(line), in) == NULL)
+	goto done;		/* hung up without asking anything */
+    if (parse_request(syn, line, &size, &wav, err, sizeof(err)) != NULL)
+	goto fail;
+    /* readmidi takes the header before it looks at the length, so pad
+       out short requests with zeroes rather than read past the end */
+    if ((buf = calloc(1, size + 32)) == NULL) {
+	snprintf(err, sizeof(err), "out of memory");
+	goto fail;
+    }
+    if (fread(buf, 1, size, in) != size) {
+	snprintf(err, sizeof(err), "midi file shorter than size");
+	goto fail;
+    }
+    memset(song, 0, sizeof(struct midisong));
+    if (readmidi(song, buf, size) <= 0) {
+	snprintf(err, sizeof(err), "can't read midi data");
+	goto fail;
+    }
+    fprintf(out, "OK %s %d\n", wav ? "wav" : "pcm", (int) syn->rate);
+    /* the output now belongs to the synth, which closes it when done */
+    synth_open_rw(syn, SDL_RWFromFP(out, SDL_TRUE), wav);
+    out = NULL;
+    t0 = SDL_GetPerformanceCounter();
+    playevents(syn, song);	/* stops early if the client goes away */
+    synth_close_out(syn);
+    secs = (syn->samplepos - syn->songpos) / syn->rate;
+    wall = (double) (SDL_GetPerformanceCounter() - t0) /
+	SDL_GetPerformanceFrequency();
+    if (syn->out_failed)
+	printf("request: client gone after %.1f s\n", secs);
+    else
+	printf("request: %.1f s in %.2f s, rtf %.4f, peak polyphony %d\n",
+	       secs, wall, secs > 0 ? wall / secs : 0.0, syn->poly_peak);
+    fflush(stdout);
+    goto done;
+  fail:
+    fprintf(out, "ERR %s\n", err);
+    /* closing with the request still unread resets the connection and
+       can take the reply with it, so half close and eat the rest first */
+    fflush(out);
+    shutdown(fd, SHUT_WR);
+    for (size = 0; size < REQ_MAXSIZE && (n = fread(line, 1,
+						     sizeof(line), in)) > 0;)
+	size += n;
+  done:
+    free(buf);
+    fclose(in);
+    if (out)
+	fclose(out);
+}
+
+/* server thread: a synth of its own, kept between the requests it takes */
+static int serve_worker(void *data)
+{
+    struct midisong *song = malloc(sizeof(struct midisong));
+    struct synth *syn = synth_new(sf2_filename);
+    int fd;
+
+    if (song == NULL || syn == NULL) {
+	fprintf(stderr, "server thread: out of memory\n");
+	free(song);
+	synth_free(syn);
+	return -1;
+    }
+    for (;;) {
+	if ((fd = accept(listen_fd, NULL, NULL)) == -1) {
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    perror("accept");
+	    break;
+	}
+	serve_client(syn, song, fd);
+    }
+    synth_free(syn);
+    free(song);
+    return 0;
+}
+
+/* listen on unix socket path, rendering renderthreads requests at once */
+int serve(char *path)
+{
+    struct sockaddr_un addr;
+    SDL_Thread **thread;
+    struct stat info;
+    int i, n;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+	fprintf(stderr, "%s: socket path too long\n", path);
+	return 1;
+    }
+    /* a client hanging up mid song is a failed write, not the end of us */
+    signal(SIGPIPE, SIG_IGN);
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+	perror("socket");
+	return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (lstat(path, &info) == 0 && S_ISSOCK(info.st_mode))
+	unlink(path);		/* left behind by an earlier server */
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+	listen(listen_fd, 64) == -1) {
+	perror(path);
+	return 1;
+    }
+    n = renderthreads > 0 ? renderthreads : SDL_GetCPUCount();
+    if ((thread = calloc(n, sizeof(SDL_Thread *))) == NULL) {
+	perror("calloc");
+	return 1;
+    }
+    for (i = 0; i < n; i++)
+	if ((thread[i] = SDL_CreateThread(serve_worker, "render server",
+					  NULL)) == NULL) {
+	    fprintf(stderr, "SDL_CreateThread: %s\n", SDL_GetError());
+	    break;
+	}
+    if (verbose)
+	fprintf(stderr, "serving %s on %d threads\n", path, i);
+    if (i == 0)
+	serve_worker(NULL);
+    while (i-- > 0)
+	SDL_WaitThread(thread[i], NULL);
+    free(thread);
+    close(listen_fd);
+    return 1;
+}
+/* end of file */
@@ -203,6 +203,23 @@ struct __attribute__ ((__packed__)) sfSample {  /* shdr */
   SFSampleLink sfSampleType;
 };
 
+/* float copy of one sample, made when first queued, see cache_sample() */
+#define CACHE_GUARD 3           /* frames of guard after loop end and end */
+struct sfCache {
+  float *data;                  // normalized frames dwStart to dwEnd + guard
+  _Atomic int state;            // 0 empty, 1 being filled, 2 data is ready
+  int loop;                     // nonzero if the loop points can use seam
+  float seam[CACHE_GUARD * 2];  // frames before dwEndloop, then dwStartloop
+};
+
+/* one key/velocity region of a preset, see compile_zones() */
+struct sfZone {
+  Uint8 keylo, keyhi;           // key range, preset and instrument combined
+  Uint8 vello, velhi;           // velocity range, likewise
+  int shdr;                     // sample to play, < 0 means the note is silent
+  Uint32 gen, gen_max;          // merged generators for the region in zgen
+};
+
 /* this structure is filled out pointing to relevant bits in the loaded file */
 /* note: the Uint32 size *MUST* directly follow each section pointer */
 struct sfSFBK {
@@ -250,7 +267,25 @@ struct sfSFBK {
   Uint32 igen_size;             // size of igen chunk in bytes
   struct sfSample *shdr;        // array of all samples within smpl chunk (req)
   Uint32 shdr_size;             // size of shdr chunk in bytes
+  struct sfCache *cache;        // float cache for each shdr entry (not riff)
+  Uint32 cache_size;            // bytes of sample data held in float cache
+  struct sfZone *zone;          // regions of all presets, in match order
+  Uint32 zone_size;             // size of zone array in bytes
+  struct sfGenList *zgen;       // merged generators of every region
+  Uint32 zgen_size;             // size of zgen array in bytes
+  Uint32 *zkey;                 // per preset, 129 zlist offsets indexed by key
+  Uint32 zkey_size;             // size of zkey array in bytes
+  Uint32 *zlist;                // zone indexes that can match each key
+  Uint32 zlist_size;            // size of zlist array in bytes
+  struct riffChunk *riff;       // sfbk chunk of the file the pointers are in
+  void *map;                    // the file, mapped read-only
+  size_t map_size;              // size of the mapping in bytes
+  int compiled;                 // map is a bank, zone arrays point into it
 };
 
-extern struct sfSFBK sf2;  /* pointers to everything loaded go here */
+/* soundfonts are read-only once loaded and shared by every load_sf2() caller */
+extern struct sfSFBK *load_sf2(char *filename); /* NULL if it can't be used */
+extern void release_sf2(struct sfSFBK *sf2);
+extern struct sfCache *cache_sample(struct sfSFBK *sf2, int shdr);
+extern int save_bank(char *filename, char *bankname); /* compile to bank */
 extern struct riffChunk *load_riff(char *filename); /* load soundfont */
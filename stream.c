@@ -0,0 +1,241 @@
+/************************************************************************
+   stream.c  -- render a live stream of midi events to pcm on stdout
+
+   Copyright 2015 Nathan Laredo (laredo@gnu.org)
+
+   This program is modifiable/redistributable under the terms
+   of the GNU General Public Licence.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+   The stream is laid out like the body of a midi file track with one
+   tick per millisecond: each event is a variable length delta time in
+   ms since the one before, then the event, with running status.  Sysex
+   is f0 or f7, a variable length count and the bytes, and meta events
+   are ff, type, count and bytes; all are ignored except end of track,
+   which ends the stream as end of file does.  Other system messages
+   are skipped, so a real-time byte (f8 - fe) does nothing but move the
+   time forward, and a sender with nothing to play can keep the output
+   flowing with timing clocks.  A status byte where a channel event
+   expects data cuts that event short, as on a midi cable: the event is
+   dropped and the status byte starts the next one, with no delta.
+
+   The output is interleaved stereo 32 bit float in host byte order.
+   Time only moves with the stream: before every read of more input,
+   the audio up to the last event read has been rendered and written,
+   but for the part of a block (512 samples) it falls in, so at most
+   a block is held back waiting for more, and nothing is ever rendered
+   past what the sender has asked for.
+ *************************************************************************/
+#include "playmidi.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define STREAM_MAXDATA	4096	/* longer sysex is skipped, not sent */
+
+extern int verbose;
+extern int cmdlen[16];
+extern char *sf2_filename;
+extern void seq_reset(struct synth *, int);
+extern int seq_wait(struct synth *, Uint32, Uint32);
+extern void start_channels(struct synth *);
+extern void play_event(struct synth *, int, unsigned char *, int);
+extern struct synth *synth_new(char *);
+extern void synth_free(struct synth *);
+extern int synth_open_rw(struct synth *, SDL_RWops *, int);
+extern void synth_close_out(struct synth *);
+
+struct midistream {
+    int fd;
+    unsigned char buf[4096];	/* bytes read but not parsed yet */
+    int pos, len;
+    Uint64 arrived;		/* when the bytes in buf were read */
+    /* time from bytes arriving to the audio up to them being written */
+    Uint64 reads, lat_total, lat_max;
+};
+
+/* write out all the audio rendered so far, and note how long it took */
+/* since the input it renders arrived */
+static void stream_flush(struct midistream *in)
+{
+    Uint64 lat;
+
+    fflush(stdout);
+    if (in->arrived) {
+	lat = SDL_GetPerformanceCounter() - in->arrived;
+	in->reads++;
+	in->lat_total += lat;
+	if (lat > in->lat_max)
+	    in->lat_max = lat;
+	in->arrived = 0;
+    }
+}
+
+/* next byte of the stream, or -1 at its end */
+static int next_byte(struct midistream *in)
+{
+    ssize_t n;
+
+    if (in->pos == in->len) {
+	stream_flush(in);	/* about to wait for more, send what we have */
+	while ((n = read(in->fd, in->buf, sizeof(in->buf))) == -1 &&
+	       errno == EINTR);
+	if (n <= 0)
+	    return -1;
+	in->arrived = SDL_GetPerformanceCounter();
+	in->pos = 0;
+	in->len = n;
+    }
+    return in->buf[in->pos++];
+}
+
+/* variable length number from the stream, -1 if it ended first */
+static long next_number(struct midistream *in)
+{
+    long value = 0;
+    int c, i;
+
+    for (i = 0; i < 4; i++) {
+	if ((c = next_byte(in)) == -1)
+	    return -1;
+	value = (value << 7) | (c & 0x7f);
+	if (!(c & 0x80))
+	    break;
+    }
+    return value;
+}
+
+/* read count bytes into data, keeping the first max of them */
+static int next_bytes(struct midistream *in, unsigned char *data,
+		      long count, long max)
+{
+    long i;
+    int c;
+
+    for (i = 0; i < count; i++) {
+	if ((c = next_byte(in)) == -1)
+	    return -1;
+	if (i < max)
+	    data[i] = c;
+    }
+    return 0;
+}
+
+/* read the count data bytes of a channel event into data.  returns 0,
+   -1 if the stream ended, or 1 if a status byte came first, which is
+   left to be read as the start of the next event */
+static int next_data(struct midistream *in, unsigned char *data, long count)
+{
+    long i;
+    int c;
+
+    for (i = 0; i < count; i++) {
+	if ((c = next_byte(in)) == -1)
+	    return -1;
+	if (c & 0x80) {
+	    in->pos--;		/* still in buf, it was just read */
+	    return 1;
+	}
+	data[i] = c;
+    }
+    return 0;
+}
+
+/* render the midi stream from path ("-" for stdin) to stdout */
+int stream_render(char *path)
+{
+    struct midistream *in = calloc(1, sizeof(struct midistream));
+    unsigned char data[STREAM_MAXDATA];
+    struct synth *syn;
+    Uint32 now = 0;
+    Uint64 events = 0;
+    double freq = SDL_GetPerformanceFrequency() / 1000.0;
+    long delta, length;
+    int c, cut = 0, status = 0;
+
+    if (in == NULL) {
+	perror("calloc");
+	return 1;
+    }
+    if (strcmp(path, "-") == 0)
+	in->fd = STDIN_FILENO;
+    else if ((in->fd = open(path, O_RDONLY)) == -1) {
+	perror(path);
+	free(in);
+	return 1;
+    }
+    if ((syn = synth_new(sf2_filename)) == NULL ||
+	synth_open_rw(syn, SDL_RWFromFP(stdout, SDL_FALSE), 0) < 0) {
+	fprintf(stderr, "can't render to stdout\n");
+	synth_free(syn);
+	free(in);
+	return 1;
+    }
+    seq_reset(syn, 0);
+    start_channels(syn);
+    while ((delta = cut ? 0 : next_number(in)) != -1 &&
+	   (c = next_byte(in)) != -1) {
+	cut = 0;
+	if (delta > 0) {
+	    now += delta;
+	    while (seq_wait(syn, now, 0));	/* the audio up to now is final */
+	    syn->ticks = now;
+	}
+	if (c < 0x80) {			/* running status, c is data */
+	    if (status == 0)
+		continue;
+	    data[0] = c;
+	    length = cmdlen[status >> 4];
+	    if ((cut = next_data(in, &data[1], length - 1)) == -1)
+		break;
+	    if (cut)
+		continue;
+	} else if (c < 0xf0) {
+	    status = c;
+	    length = cmdlen[status >> 4];
+	    if ((cut = next_data(in, data, length)) == -1)
+		break;
+	    if (cut)
+		continue;
+	} else if (c == 0xf0 || c == 0xf7) {
+	    if ((length = next_number(in)) == -1 ||
+		next_bytes(in, data, length, sizeof(data)) == -1)
+		break;
+	    if (length <= sizeof(data))
+		play_event(syn, c, data, length);
+	    continue;
+	} else if (c == 0xff) {
+	    if ((c = next_byte(in)) == -1 || (length = next_number(in)) == -1 ||
+		next_bytes(in, data, length, 0) == -1 || c == 0x2f)
+		break;		/* 2f is end of track */
+	    continue;
+	} else {
+	    /* system common takes its data bytes with it, real-time is
+	       only here for its delta */
+	    length = c == 0xf2 ? 2 : c == 0xf1 || c == 0xf3;
+	    if (next_bytes(in, data, length, 0) == -1)
+		break;
+	    continue;
+	}
+	play_event(syn, status, data, length);
+	events++;
+    }
+    synth_close_out(syn);	/* ring out and write the last of it */
+    fflush(stdout);
+    if (verbose)
+	fprintf(stderr, "stream: %lu events, %.1f s of audio, "
+		"read to write latency %.3f ms mean, %.3f ms max\n",
+		(unsigned long) events,
+		(syn->samplepos - syn->songpos) / syn->rate,
+		in->reads ? in->lat_total / freq / in->reads : 0.0,
+		in->lat_max / freq);
+    if (in->fd != STDIN_FILENO)
+	close(in->fd);
+    synth_free(syn);
+    free(in);
+    return 0;
+}
+/* end of file */